@@ -0,0 +1,44 @@
+uniform sampler2D scattering;
+uniform vec2 radii;
+
+varying vec3 position, eye, sun;
+
+const float sunIntensity = 12.0;
+const float lutScale = 2.0;
+const float musSize = 64.0;
+const float nuSize = 16.0;
+const float g = 0.76;
+
+/* One nu slice of the table, kept off its neighbours by the texel centers */
+vec4 slice (float mus, float k, float v)
+{
+    float u = ((mus * 0.5 + 0.5) * (musSize - 1.0) + 0.5) / musSize;
+    return texture2D (scattering, vec2 ((k + u) / nuSize, v));
+}
+
+void main()
+{
+    vec3 d = normalize (position - eye);
+    vec3 s = normalize (sun);
+    
+    /* Point of the view ray closest to the center */
+    vec3 m = position - dot (position, d) * d;
+    float p = length (m);
+    vec3 n = (p > 0.0001) ? m / p : normalize (position);
+    
+    /* Same parametrization as the precomputed table, interpolated by hand between nu slices */
+    float mus = clamp (dot (n, s), -1.0, 1.0);
+    float nu = clamp (dot (d, s), -1.0, 1.0);
+    float v = (p < radii.x) ? 0.5 * p / radii.x : 0.5 + 0.5 * (p - radii.x) / (radii.y - radii.x);
+    float x = (nu * 0.5 + 0.5) * (nuSize - 1.0);
+    float k = min (floor (x), nuSize - 2.0);
+    vec4 inscatter = mix (slice (mus, k, v), slice (mus, k + 1.0, v), x - k) * lutScale;
+    
+    /* Rayleigh and Henyey-Greenstein phase functions */
+    float phaseR = 0.0596831 * (1.0 + nu * nu);
+    float phaseM = 0.1193662 * (1.0 - g * g) * (1.0 + nu * nu) / ((2.0 + g * g) * pow (1.0 + g * g - 2.0 * g * nu, 1.5));
+    
+    vec3 color = (inscatter.rgb * phaseR + inscatter.a * phaseM) * sunIntensity;
+    
+    gl_FragColor = vec4 (1.0 - exp (-color), 0.0);
+}
@@ -0,0 +1,11 @@
+varying vec3 position, eye, sun;
+
+void main()
+{
+    /* Everything in object space, where the earth is a sphere */
+    position = gl_Vertex.xyz;
+    eye = (gl_ModelViewMatrixInverse * vec4 (0.0, 0.0, 0.0, 1.0)).xyz;
+    sun = (gl_ModelViewMatrixInverse * vec4 (gl_LightSource[1].position.xyz, 0.0)).xyz;
+
+    gl_Position = ftransform ();  
+}
@@ -0,0 +1,13 @@
+uniform sampler2D cloudstex, oldtex;
+uniform float fade;
+
+varying vec4 color;
+
+void main()
+{
+    /* Crossfade from the previous cloudmap to the new one, both only hold the cloud alpha */
+    float alpha = mix (texture2D (oldtex, gl_TexCoord[0].st).a, texture2D (cloudstex, gl_TexCoord[0].st).a, fade);
+    
+    /* Expand to lit white clouds */
+    gl_FragColor = vec4 (clamp (color.rgb, 0.0, 1.0), color.a * alpha);
+}
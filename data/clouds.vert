@@ -0,0 +1,17 @@
+varying vec4 color;
+
+void main()
+{
+    /* Same lighting as the fixed pipeline: ambient and diffuse, no specular on the clouds */
+    vec3 normal = normalize (gl_NormalMatrix * gl_Normal);
+    vec3 lightDir = normalize (vec3(gl_LightSource[1].position));
+    
+    color = (gl_LightSource[1].ambient + gl_LightModel.ambient) * gl_FrontMaterial.ambient;
+    color += max (dot (normal, lightDir), 0.0) * gl_LightSource[1].diffuse * gl_FrontMaterial.diffuse;
+    color.a = gl_FrontMaterial.diffuse.a;
+    
+    /* Texture */
+    gl_TexCoord[0] = gl_MultiTexCoord0;
+
+    gl_Position = ftransform ();  
+}
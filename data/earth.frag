@@ -1,6 +1,15 @@
 #version 130
 
-uniform sampler2D daytex, nighttex;
+/* Cubemaps sampled by direction, or the plain equirectangular maps */
+#ifdef EQUIRECT
+uniform sampler2D daytex, nighttex, nexttex;
+#define sampleMap(map) texture2D (map, gl_TexCoord[0].st)
+#else
+uniform samplerCube daytex, nighttex, nexttex;
+#define sampleMap(map) textureCube (map, gl_TexCoord[0].stp)
+#endif
+uniform float season;
+uniform sampler2D transmittance;
 
 varying vec3 normal, halfVect, lightDir;
 varying vec4 ambient, diffuse;
@@ -12,21 +21,30 @@ void main()
     float NdotL, NdotHV;
     
     /* Texture data */
-    vec4 daytexel = texture2D (daytex, gl_TexCoord[0].st);
-    vec4 nighttexel = texture2D (nighttex, gl_TexCoord[0].st);
+    vec4 daytexel = sampleMap (daytex);
+    
+    /* Blend into the next month at the end of this one */
+    if (season > 0.0)
+        daytexel = mix (daytexel, sampleMap (nexttex), season);
+    vec4 nighttexel = sampleMap (nighttex);
     
     normal_ = normalize (normal);
     
-    /* Tweak NdotL a bit to make a brighter day, and roughly simulate atmosphere scattening extending the day beyond the strict line */
-    NdotL = clamp (dot (normal_, lightDir)*2 + 0.2, 0.0, 1.0);
+    /* Tweak NdotL a bit to make a brighter day */
+    float mu = dot (normal_, lightDir);
+    NdotL = clamp (mu*2, 0.0, 1.0);
+    
+    /* Sunlight left after crossing the atmosphere, reddening towards the terminator */
+    vec4 sunlight = vec4 (texture2D (transmittance, vec2 (mu*0.5 + 0.5, 0.0)).rgb, 1.0);
     
     vec4 color;
     
     /* Ambient and diffuse light with day texture */    
-    color = (ambient + NdotL*diffuse) * daytexel;
+    color = (ambient + NdotL*diffuse*sunlight) * daytexel;
     
-    /* Display the night lights on top of the night side, with a little gradient.*/
-    float coeff = clamp((1-NdotL-0.9)*10 ,0,1);
+    /* Display the night lights on top of the night side, with a little gradient.
+     * Where the former brighter NdotL (mu*2 + 0.2) put it, past the terminator */
+    float coeff = clamp((-mu*2 - 0.2 + 0.1)*10 ,0,1);
     
     color += nighttexel * coeff;
     
@@ -12,8 +12,12 @@ void main()
     ambient = (gl_LightSource[1].ambient + gl_LightModel.ambient) * gl_FrontMaterial.ambient;
     diffuse = gl_LightSource[1].diffuse * gl_FrontMaterial.diffuse;
     
-    /* Texture */
+    /* Texture, cubemap directions or equirectangular coordinates */
+#ifdef EQUIRECT
+    gl_TexCoord[0] = gl_MultiTexCoord1;
+#else
     gl_TexCoord[0] = gl_MultiTexCoord0;
+#endif
 
     gl_Position = ftransform ();  
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+/*
+ * Compiz Earth plugin
+ *
+ * cache.h
+ *
+ * Process-wide cache of the plugin resources, shared by all the screens
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+
+#ifndef __EARTH_CACHE_H__
+#define __EARTH_CACHE_H__
+
+#include <core/core.h>
+#include <GL/glew.h>
+
+/* Decoded image, faces are stored one after the other */
+struct CachedImage
+{
+    CompString key;
+    CompSize size;
+    int channels;	/* bytes per texel: 1 alpha, 4 BGRA, 8 RGBA with 16 bits channels */
+    int faces;
+    void* data;
+    size_t length;
+    int refs;
+    bool loading;	/* in the list while its loader runs, the others wait for it */
+};
+
+/* Fills size, channels and faces and returns malloc'ed data, or NULL on failure */
+typedef void* (*CacheLoader) (const CompString& source, CachedImage* image, void* closure);
+
+/* Builds count display lists starting at base */
+typedef void (*CacheListsBuilder) (GLuint base, int count, void* closure);
+
+/*
+ * Decoded images are kept in shared memory segments keyed on the source path,
+ * its modification time and size, so they outlive the plugin and a reload only
+ * maps them again. variant tells apart several images made from one source.
+ */
+CachedImage* cacheAcquireImage (const CompString& source, const CompString& variant, CacheLoader loader, void* closure);
+void cacheReleaseImage (CachedImage* image);
+
+/* Removes the shared memory copy of an image that will not be needed again soon */
+void cacheDiscardImage (const CompString& source, const CompString& variant);
+
+/* GL resources are refcounted per GL context, 6 faces images become cubemaps */
+GLuint cacheAcquireTexture (const CompString& source, const CompString& variant, CacheLoader loader, void* closure);
+void cacheReleaseTexture (GLuint texture);
+
+/* defines are added at the top of both shaders, to build variants of one program */
+GLuint cacheAcquireProgram (const CompString& name, const CompString& defines = "");
+void cacheReleaseProgram (GLuint program);
+
+GLuint cacheAcquireLists (const CompString& name, int count, CacheListsBuilder builder, void* closure);
+void cacheReleaseLists (GLuint base);
+
+#endif
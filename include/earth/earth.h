@@ -29,6 +29,8 @@
 #define __EARTH_H__
 
 #include <cmath>
+#include <ctime>
+#include <cstring>
 #include <fstream>
 #include <sys/stat.h>
 #include <curl/curl.h>
@@ -37,13 +39,22 @@
 #include <GL/glew.h>
 #include <cube/cube.h>
 #include "earth_options.h"
+#include "process.h"
+#include "ring.h"
 
 enum
 {
 	DAY=0,
 	NIGHT=1,
 	CLOUDS=2,
-	SKY=3
+	SKY=3,
+	ATMOSPHERE=4
+};
+
+enum
+{
+	TRANSMITTANCE=0,
+	SCATTERING=1
 };
 
 enum
@@ -52,6 +63,20 @@ enum
 	SUN=1
 };
 
+/* The earth and the clouds are also split in patches, culled behind the horizon one by one */
+#define EARTH_RADIUS 0.89
+#define CLOUDS_RADIUS 0.9
+#define PATCH_ROWS 8
+#define PATCH_COLUMNS 16
+#define SPHERE_PATCHES (PATCH_ROWS * PATCH_COLUMNS)
+
+/* Bounding cone of the directions from the center to a patch */
+struct SpherePatch
+{
+    GLfloat axis[3];
+    GLfloat angle;
+};
+
 struct LightParam
 {
     GLfloat ambient[4];
@@ -106,7 +131,9 @@ public:
 
 struct _TexThreadData{    CompScreen* s;    int num;    pthread_t tid; EarthScreen* base;};
 
-struct CloudsThreadData{    CompScreen* s;    pthread_t tid;    int started;    int finished; EarthScreen* base;};
+struct CloudsThreadData{    CompScreen* s;    pthread_t tid;    int started;    int finished;    int resolution;    int history;    char error[CLOUDS_ERROR_LENGTH]; EarthScreen* base;};
+
+struct SeasonThreadData{    CompScreen* s;    pthread_t tid;    int started;    int finished;    CompString file;    struct CachedImage* image;    char error[PNG_ERROR_LENGTH]; EarthScreen* base;};
 
 struct CloudsFile
 {
@@ -114,36 +141,93 @@ struct CloudsFile
     FILE* stream;
     EarthScreen* base;
 };
+
+/* Double-buffered single-channel cloud texture, the back one is filled in row bands */
+struct CloudsUpload
+{
+    GLuint tex [2];
+    CompSize size [2];
+    time_t time [2];
+    time_t pending;
+    int front;
+    int row;
+    GLuint pbo;
+    float fade;
+};
     
     /* Clouds */
     CURL* curlhandle;
     CloudsFile cloudsfile;
+    CloudsUpload cloudsupload;
+    CloudsRing cloudsring;
+    CompString ringbase;
 	float updateTime;
+	void createCloudsTextures ();
+	void deleteCloudsTextures ();
+	void uploadCloudsBands (float budget);
+	void uploadClouds (int index, const unsigned char* data, CompSize size, time_t stamp);
+	void drawClouds ();
+	void createAtmosphere ();
+	void deleteAtmosphere ();
+	void drawAtmosphere ();
+	int cloudsResolution ();
+    
+    /* Seasons, day textures of the current month and the next one */
+    SeasonThreadData seasonthreaddata;
+    int month [2];
+    CompString dayfile;
+    GLuint nexttex;
+    float season;
+	CompString dayFile (int month);
+	void updateSeason (struct tm* t);
     
     /* Textures */
 	struct { void* image; CompSize size; } imagedata [4];
 	//CompSize csize [4];
-    GLTexture::List tex [4];
+    GLuint tex [4];
+    bool cubemaps;
+    bool software;
+    GLenum maptarget;
+	GLuint acquireMap (const CompString& file);
+	bool softwareRenderer ();
+	bool useCubemaps ();
+	bool useAtmosphere ();
 
 //private:
     /* Threads */
     _TexThreadData TexThreadData [4];
     CloudsThreadData cloudsthreaddata;
-	void makeSphere (GLdouble radius, GLboolean inside);
+	void makeSphere (GLdouble radius, GLboolean inside, GLboolean cube = FALSE,
+			 GLint row = 0, GLint rows = 64, GLint column = 0, GLint columns = 64);
     
     /* Rendering */
-    GLuint list [4];
+    GLuint list [5];
+    
+    /* Patches, and the eye in the earth coordinates for the current frame */
+    SpherePatch patches [SPHERE_PATCHES];
+    GLfloat eye [3];
+    bool eyevalid;
+    GLenum backface;
+    int cullframes;
+    double culltotal;
+	void drawPatches (int sphere);
+    
+    /* Atmosphere lookup tables */
+    GLuint lut [2];
+    
+    /* GPU timing of the earth, for the debug option */
+    GLuint timequery;
+    bool timepending;
+    int timeframes;
+    double timetotal;
     
     /* Shaders */
     GLboolean shadersupport;
-    CompString vertfile[1];
-    CompString vertsource[1];
-    CompString fragfile[1];
-    CompString fragsource[1];
-    GLuint vert [1];
-    GLuint frag [1];
-    GLuint prog [1];
-    GLint texloc [2];
+    GLuint prog [5];
+    GLint texloc [3];
+    GLint oldloc, fadeloc;
+    GLint nextloc, seasonloc;
+    GLint earthlutloc, lutloc, radiiloc;
 };
 
 #define EARTH_SCREEN(s) EarthScreen *es = EarthScreen::get (s);
@@ -156,10 +240,17 @@ struct EarthPluginVTable : public CompPlugin::VTableForScreen<EarthScreen>
 CompString LoadSource (const char* filename);
 
 static size_t writecloudsfile(void *buffer, size_t size, size_t nmemb, void *stream);
-void TransformClouds (CompScreen* s);
+bool TransformClouds (const char* filename, int resolution, void*& image, CompSize& size, char* error);
 //EarthDisplay* getEarthDisplay(CompDisplay *d);
 //EarthScreen* getEarthScreen(CompScreen *s, EarthDisplay *ed);
 	void* DownloadClouds_t (void* threaddata);
+	void* PrefetchSeason_t (void* threaddata);
 	void* loadTexture (void* threaddata);
+	void* loadImage (const CompString& source, struct CachedImage* image, void* closure);
+	void* loadCubeImage (const CompString& source, struct CachedImage* image, void* closure);
+	void* loadPngImage (const CompString& source, struct CachedImage* image, void* closure);
+	void* loadPngCubeImage (const CompString& source, struct CachedImage* image, void* closure);
+	void* loadTransmittance (const CompString& source, struct CachedImage* image, void* closure);
+	void* loadScattering (const CompString& source, struct CachedImage* image, void* closure);
 
 #endif
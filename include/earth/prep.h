@@ -0,0 +1,62 @@
+/*
+ * Compiz Earth plugin
+ *
+ * prep.h
+ *
+ * Files of processed images shared by the plugin cache and earth-prep, independent from compiz
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+
+#ifndef __EARTH_PREP_H__
+#define __EARTH_PREP_H__
+
+#include <string>
+#include <stdint.h>
+
+#define CACHE_MAGIC "EARTH001"
+#define CACHE_HEADER_SIZE 1024
+
+/*
+ * Header of the shared memory segments and of the files written by earth-prep,
+ * the data follows at CACHE_HEADER_SIZE, faces one after the other.
+ */
+struct CacheHeader
+{
+    char magic[8];
+    int32_t width, height, channels, faces;
+    char key[CACHE_HEADER_SIZE - 24];
+};
+
+/* Source identity: resolved path, variant, modification time and size */
+std::string prepKey (const std::string& source, const std::string& variant);
+
+/* Processed copy of a source, in prep/ next to it, or when there is no source in prep/
+ * under images, a directory ending with a slash, the plugin images by default */
+std::string prepFile (const std::string& source, const std::string& variant, const std::string& images = "");
+
+/* Maps a whole file holding the image for key, NULL if it holds anything else
+ * or if it is not owned and writable by the user alone */
+void* prepMap (int fd, const std::string& key, size_t* length);
+
+/* The magic is written last, so that a half written header is never used */
+void prepFillHeader (CacheHeader* header, const std::string& key, int width, int height, int channels, int faces);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Compiz Earth plugin
+ *
+ * process.h
+ *
+ * Image processing of the earth textures, independent from compiz
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+
+#ifndef __EARTH_PROCESS_H__
+#define __EARTH_PROCESS_H__
+
+/* Processes items [begin, end) */
+typedef void (*ParallelRange) (int begin, int end, void* closure);
+
+/* Splits [0, count) in one range per core and waits for all of them */
+void parallelFor (int count, ParallelRange range, void* closure);
+
+/*
+ * Decodes a JPEG cloudmap straight to a single-channel image flipped vertically,
+ * downscaled in the DCT domain by 1/2 or 1/4 as long as it stays at least
+ * resolution texels wide. Returns malloc'ed data, or NULL with the reason in
+ * error, left empty when the file does not exist.
+ */
+#define CLOUDS_ERROR_LENGTH 200
+
+unsigned char* decodeClouds (const char* filename, int resolution, int* width, int* height, char* error);
+
+/* Size decodeClouds gives, or the size of a PNG cloudmap, from the header alone */
+bool cloudsSize (const char* filename, int resolution, int* width, int* height);
+
+/*
+ * Decodes a PNG the way compiz does: BGRA in a native endian word, with the
+ * alpha premultiplied if asked. Returns malloc'ed data, or NULL with the reason
+ * in error. Unlike the compiz image loading, it can run on any thread.
+ */
+#define PNG_ERROR_LENGTH 200
+
+unsigned char* decodePng (const char* filename, int* width, int* height, bool premultiply, char* error);
+
+/*
+ * Cubemaps are stored as 6 square faces in the GL order (+X, -X, +Y, -Y, +Z, -Z).
+ * Directions map to the equirectangular maps the same way as the sphere texture
+ * coordinates: v = 0 at +Z, u = 1 - atan2 (x, y) / 2pi.
+ */
+
+/* Face size giving the four equatorial faces the texel count of the equator */
+int cubeFaceSize (int width);
+
+/* Reprojects rows [begin, end) of the cubemap, counted across the 6 faces */
+void reprojectCubeRows (const unsigned char* src, int width, int height, int channels,
+			unsigned char* dst, int size, int begin, int end);
+
+/* Reprojects the whole cubemap on all cores */
+void reprojectCube (const unsigned char* src, int width, int height, int channels,
+		    unsigned char* dst, int size);
+
+/*
+ * Atmosphere lookup tables, RGBA 16 bits per channel. The atmosphere is 4 times
+ * thicker than the real one so that it shows at desktop scale, with the scale
+ * heights and scattering coefficients adjusted to keep the real optical depths.
+ *
+ * Transmittance to the top of the atmosphere: u = (mu + 1) / 2 with mu the cosine
+ * of the view zenith angle, v = altitude / thickness.
+ *
+ * Single scattering along a whole ray seen from far away, without the phase
+ * functions. mu_s is the cosine of the sun zenith angle at the point of the ray
+ * closest to the center and nu the cosine of the angle between the ray and the
+ * sun, the sun zenith cosine along the ray is then (p mu_s + t nu) / r. The table
+ * is an atlas of ATMOSPHERE_SCATTERING_NU slices side by side, slice k for
+ * nu = -1 + 2 k / (NU - 1), each one ATMOSPHERE_SCATTERING_MUS texels wide with
+ * texel i for mu_s = -1 + 2 i / (MUS - 1). v = p / 2 Rg below the ground and
+ * 1/2 + (p - Rg) / 2 (Rt - Rg) above it, with p the ray distance to the center.
+ * Rayleigh goes in RGB, Mie in A, both divided by ATMOSPHERE_SCATTERING_SCALE.
+ */
+#define ATMOSPHERE_RG 6360.0f
+#define ATMOSPHERE_RT 6600.0f
+#define ATMOSPHERE_TRANSMITTANCE_WIDTH 256
+#define ATMOSPHERE_TRANSMITTANCE_HEIGHT 64
+#define ATMOSPHERE_SCATTERING_MUS 64
+#define ATMOSPHERE_SCATTERING_NU 16
+#define ATMOSPHERE_SCATTERING_WIDTH (ATMOSPHERE_SCATTERING_MUS * ATMOSPHERE_SCATTERING_NU)
+#define ATMOSPHERE_SCATTERING_HEIGHT 128
+#define ATMOSPHERE_SCATTERING_SCALE 2.0f
+
+/* Cache variants of the tables, bumped whenever they are computed differently */
+#define ATMOSPHERE_TRANSMITTANCE_VARIANT "atmosphere-transmittance-1"
+#define ATMOSPHERE_SCATTERING_VARIANT "atmosphere-scattering-2"
+
+void transmittanceRows (unsigned short* dst, int begin, int end);
+void scatteringRows (unsigned short* dst, int begin, int end);
+
+/* Computes the whole tables on all cores */
+void computeTransmittance (unsigned short* dst);
+void computeScattering (unsigned short* dst);
+
+#endif
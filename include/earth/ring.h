@@ -0,0 +1,74 @@
+/*
+ * Compiz Earth plugin
+ *
+ * ring.h
+ *
+ * Memory-mapped history of the processed cloudmaps, independent from compiz
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+
+#ifndef __EARTH_RING_H__
+#define __EARTH_RING_H__
+
+#include <ctime>
+#include <string>
+#include <stdint.h>
+
+#define CLOUDS_RING_MAGIC "EARTHRNG"
+#define CLOUDS_RING_MAX 16
+#define CLOUDS_RING_HEADER_SIZE 4096
+
+/*
+ * The file holds a header followed by a fixed number of slots, each one a
+ * cloudmap as uploaded: single channel, flipped vertically.
+ */
+struct CloudsRingHeader
+{
+    char magic[8];
+    int32_t slots, width, height;
+    int32_t count, newest;
+    int64_t time[CLOUDS_RING_MAX];
+};
+
+struct CloudsRing
+{
+    void* map;
+    size_t length;
+    CloudsRingHeader* header;
+};
+
+/* One file per geometry, base-<width>x<height>-<slots>.ring, so that screens
+ * decoding the cloudmap to different sizes keep their own history */
+std::string cloudsRingFile (const std::string& base, int slots, int width, int height);
+
+/* Maps an existing ring, false if there is none with that number of slots */
+bool cloudsRingOpen (CloudsRing* ring, const char* filename, int slots);
+void cloudsRingClose (CloudsRing* ring);
+
+/* Cloudmap age steps older than the newest one, NULL if there is none */
+const unsigned char* cloudsRingEntry (CloudsRing* ring, int age, time_t* time);
+
+/* Stores a cloudmap as the newest one, the ring is created if there is none yet,
+ * concurrent pushes to the same file are serialised with flock */
+bool cloudsRingPush (CloudsRing* ring, const char* filename, int slots,
+		     const unsigned char* data, int width, int height, time_t time);
+
+#endif
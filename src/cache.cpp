@@ -0,0 +1,426 @@
+/*
+ * Compiz Earth plugin
+ *
+ * cache.cpp
+ *
+ * Process-wide cache of the plugin resources, shared by all the screens
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <earth/earth.h>
+#include <earth/cache.h>
+#include <earth/prep.h>
+#include <glibmm/miscutils.h>
+#include <GL/glx.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <list>
+
+enum
+{
+    CACHE_TEXTURE,
+    CACHE_PROGRAM,
+    CACHE_LISTS
+};
+
+struct CachedGL
+{
+    CompString key;
+    GLXContext context;
+    int kind;
+    GLuint name;
+    int count;
+    int refs;
+};
+
+static std::list<CachedImage*> images;
+static std::list<CachedGL> resources;
+static pthread_mutex_t imagesmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t imagesloaded = PTHREAD_COND_INITIALIZER;
+
+static CompString cacheSegmentName (const CompString& source, const CompString& variant)
+{
+    /* FNV-1a, so that a changed source replaces its own segment */
+    uint64_t hash = 14695981039346656037ULL;
+    CompString id = source + "#" + variant;
+
+    for (unsigned int i = 0; i < id.size (); i++)
+    {
+	hash ^= (unsigned char) id[i];
+	hash *= 1099511628211ULL;
+    }
+
+    return compPrintf ("/compiz-earth-%u-%016llx", (unsigned int) getuid (), (unsigned long long) hash);
+}
+
+/* Maps a shared memory segment or a file written by earth-prep, fd is closed */
+static bool cacheMapFile (int fd, CachedImage* image)
+{
+    size_t length;
+    void* map = prepMap (fd, image->key, &length);
+
+    if (fd >= 0)
+	close (fd);
+    if (!map)
+	return false;
+
+    CacheHeader* header = (CacheHeader*) map;
+    image->size = CompSize (header->width, header->height);
+    image->channels = header->channels;
+    image->faces = header->faces;
+    image->data = (char*) map + CACHE_HEADER_SIZE;
+    image->length = length;
+    return true;
+}
+
+/* Move freshly loaded data to a new segment, the data stays on the heap if that fails */
+static void cacheCreateSegment (const CompString& name, CachedImage* image)
+{
+    size_t bytes = (size_t) image->size.width () * image->size.height () * image->channels * image->faces;
+    size_t length = CACHE_HEADER_SIZE + bytes;
+
+    shm_unlink (name.c_str ());
+    int fd = shm_open (name.c_str (), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+	return;
+
+    if (ftruncate (fd, length) != 0)
+    {
+	close (fd);
+	shm_unlink (name.c_str ());
+	return;
+    }
+
+    void* map = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+    {
+	shm_unlink (name.c_str ());
+	return;
+    }
+
+    /* The header goes last, so that a half written segment is never used */
+    memcpy ((char*) map + CACHE_HEADER_SIZE, image->data, bytes);
+    prepFillHeader ((CacheHeader*) map, image->key, image->size.width (), image->size.height (),
+		    image->channels, image->faces);
+
+    free (image->data);
+    image->data = (char*) map + CACHE_HEADER_SIZE;
+    image->length = length;
+}
+
+CachedImage* cacheAcquireImage (const CompString& source, const CompString& variant, CacheLoader loader, void* closure)
+{
+    CompString key = prepKey (source, variant);
+    CachedImage* image = NULL;
+
+    pthread_mutex_lock (&imagesmutex);
+
+    foreach (CachedImage* i, images)
+    {
+	if (i->key == key)
+	{
+	    image = i;
+	    image->refs++;
+	    break;
+	}
+    }
+
+    if (image)
+    {
+	/* Someone else is loading it, the other images stay available meanwhile */
+	while (image->loading)
+	    pthread_cond_wait (&imagesloaded, &imagesmutex);
+    }
+    else
+    {
+	CompString name = cacheSegmentName (source, variant);
+
+	image = new CachedImage;
+	image->key = key;
+	image->refs = 1;
+	image->data = NULL;
+	image->length = 0;
+	image->loading = true;
+	images.push_back (image);
+
+	/* The decode can take seconds, the lock is not held across it */
+	pthread_mutex_unlock (&imagesmutex);
+
+	/* Already decoded by a previous instance of the plugin, or by earth-prep */
+	if (!cacheMapFile (shm_open (name.c_str (), O_RDONLY, 0), image) &&
+	    !cacheMapFile (open (prepFile (source, variant).c_str (), O_RDONLY), image))
+	{
+	    image->data = loader (source, image, closure);
+	    if (image->data)
+		cacheCreateSegment (name, image);
+	}
+
+	pthread_mutex_lock (&imagesmutex);
+	image->loading = false;
+	if (!image->data)
+	    images.remove (image);
+	pthread_cond_broadcast (&imagesloaded);
+    }
+
+    /* A failed load is dropped by whoever holds the last reference */
+    if (!image->data)
+    {
+	if (--image->refs == 0)
+	    delete image;
+	image = NULL;
+    }
+
+    pthread_mutex_unlock (&imagesmutex);
+    return image;
+}
+
+void cacheReleaseImage (CachedImage* image)
+{
+    if (!image)
+	return;
+
+    pthread_mutex_lock (&imagesmutex);
+
+    if (--image->refs == 0)
+    {
+	/* Only unmapped, the segment itself stays for the next load */
+	if (image->length)
+	    munmap ((char*) image->data - CACHE_HEADER_SIZE, image->length);
+	else
+	    free (image->data);
+
+	images.remove (image);
+	delete image;
+    }
+
+    pthread_mutex_unlock (&imagesmutex);
+}
+
+void cacheDiscardImage (const CompString& source, const CompString& variant)
+{
+    /* Processes which still map it keep their copy */
+    shm_unlink (cacheSegmentName (source, variant).c_str ());
+}
+
+static CachedGL* cacheFindGL (int kind, const CompString& key)
+{
+    GLXContext context = glXGetCurrentContext ();
+
+    foreach (CachedGL& r, resources)
+    {
+	if (r.kind == kind && r.context == context && r.key == key)
+	{
+	    r.refs++;
+	    return &r;
+	}
+    }
+    return NULL;
+}
+
+static void cacheAddGL (int kind, const CompString& key, GLuint name, int count)
+{
+    CachedGL r;
+
+    r.key = key;
+    r.context = glXGetCurrentContext ();
+    r.kind = kind;
+    r.name = name;
+    r.count = count;
+    r.refs = 1;
+    resources.push_back (r);
+}
+
+/* Returns true when the last reference is gone and the resource has to be deleted */
+static bool cacheReleaseGL (int kind, GLuint name, int* count)
+{
+    GLXContext context = glXGetCurrentContext ();
+
+    for (std::list<CachedGL>::iterator it = resources.begin (); it != resources.end (); it++)
+    {
+	if (it->kind == kind && it->context == context && it->name == name)
+	{
+	    if (count)
+		*count = it->count;
+	    if (--it->refs > 0)
+		return false;
+	    resources.erase (it);
+	    return true;
+	}
+    }
+    return false;
+}
+
+GLuint cacheAcquireTexture (const CompString& source, const CompString& variant, CacheLoader loader, void* closure)
+{
+    CompString key = prepKey (source, variant);
+    CachedGL* r = cacheFindGL (CACHE_TEXTURE, key);
+    GLuint texture;
+
+    if (r)
+	return r->name;
+
+    CachedImage* image = cacheAcquireImage (source, variant, loader, closure);
+    if (!image)
+	return 0;
+
+    GLenum target = (image->faces == 6) ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+    size_t facebytes = (size_t) image->size.width () * image->size.height () * image->channels;
+
+    glGenTextures (1, &texture);
+    glBindTexture (target, texture);
+    glTexParameteri (target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri (target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (image->channels == 8)
+    {
+	/* Lookup tables, no mipmaps */
+	glTexParameteri (target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri (target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    }
+    else
+    {
+	glTexParameteri (target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri (target, GL_TEXTURE_WRAP_S, (target == GL_TEXTURE_2D) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri (target, GL_GENERATE_MIPMAP, GL_TRUE);
+    }
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+
+    for (int f = 0; f < image->faces; f++)
+    {
+	GLenum face = (target == GL_TEXTURE_2D) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP_POSITIVE_X + f;
+	const char* data = (const char*) image->data + f * facebytes;
+
+	if (image->channels == 1)
+	    glTexImage2D (face, 0, GL_ALPHA8, image->size.width (), image->size.height (), 0,
+			  GL_ALPHA, GL_UNSIGNED_BYTE, data);
+	else if (image->channels == 8)
+	    glTexImage2D (face, 0, GL_RGBA16, image->size.width (), image->size.height (), 0,
+			  GL_RGBA, GL_UNSIGNED_SHORT, data);
+	else
+	    glTexImage2D (face, 0, GL_RGBA, image->size.width (), image->size.height (), 0,
+			  GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+    }
+
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture (target, 0);
+
+    /* The texture has its own copy now */
+    cacheReleaseImage (image);
+
+    cacheAddGL (CACHE_TEXTURE, key, texture, 1);
+    return texture;
+}
+
+void cacheReleaseTexture (GLuint texture)
+{
+    if (cacheReleaseGL (CACHE_TEXTURE, texture, NULL))
+	glDeleteTextures (1, &texture);
+}
+
+/* The defines go after the #version line, which has to come first */
+static CompString cacheDefine (const CompString& source, const CompString& defines)
+{
+    size_t line = 0;
+
+    if (defines.empty ())
+	return source;
+    if (source.compare (0, 8, "#version") == 0)
+    {
+	line = source.find ('\n');
+	line = (line == CompString::npos) ? source.size () : line + 1;
+    }
+    return source.substr (0, line) + defines + source.substr (line);
+}
+
+GLuint cacheAcquireProgram (const CompString& name, const CompString& defines)
+{
+    CompString key = name + "#" + defines;
+    CachedGL* r = cacheFindGL (CACHE_PROGRAM, key);
+    GLuint vert, frag, prog;
+    GLint linked;
+
+    if (r)
+	return r->name;
+
+    /* Shader creation, loading and compiling */
+    vert = glCreateShader (GL_VERTEX_SHADER);
+    frag = glCreateShader (GL_FRAGMENT_SHADER);
+
+    CompString vertsource = cacheDefine (LoadSource ((Glib::getenv("HOME") + "/.compiz-1/earth/data/" + name + ".vert").c_str ()), defines);
+    CompString fragsource = cacheDefine (LoadSource ((Glib::getenv("HOME") + "/.compiz-1/earth/data/" + name + ".frag").c_str ()), defines);
+
+    const char*c=vertsource.c_str();
+    glShaderSource (vert, 1, &c, NULL);
+    c=fragsource.c_str();
+    glShaderSource (frag, 1, &c, NULL);
+
+    glCompileShader (vert);
+    glCompileShader (frag);
+
+    /* Program creation, attaching and linking */
+    prog = glCreateProgram ();
+
+    glAttachShader (prog, vert);
+    glAttachShader (prog, frag);
+
+    glLinkProgram (prog);
+
+    /* The shaders are freed along with the program */
+    glDeleteShader (vert);
+    glDeleteShader (frag);
+
+    glGetProgramiv (prog, GL_LINK_STATUS, &linked);
+    if (!linked)
+	compLogMessage ("earth", CompLogLevelError, "unable to link the %s shaders", name.c_str ());
+
+    cacheAddGL (CACHE_PROGRAM, key, prog, 1);
+    return prog;
+}
+
+void cacheReleaseProgram (GLuint program)
+{
+    if (cacheReleaseGL (CACHE_PROGRAM, program, NULL))
+	glDeleteProgram (program);
+}
+
+GLuint cacheAcquireLists (const CompString& name, int count, CacheListsBuilder builder, void* closure)
+{
+    CachedGL* r = cacheFindGL (CACHE_LISTS, name);
+    GLuint base;
+
+    if (r)
+	return r->name;
+
+    base = glGenLists (count);
+    builder (base, count, closure);
+
+    cacheAddGL (CACHE_LISTS, name, base, count);
+    return base;
+}
+
+void cacheReleaseLists (GLuint base)
+{
+    int count;
+
+    if (cacheReleaseGL (CACHE_LISTS, base, &count))
+	glDeleteLists (base, count);
+}
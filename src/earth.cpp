@@ -25,12 +25,39 @@
  */
 
 #include <earth/earth.h>
+#include <earth/cache.h>
 #include <glibmm/miscutils.h>
+#include <algorithm>
 
 COMPIZ_PLUGIN_20090315 (earth, EarthPluginVTable)
 
 static CompString pname = "earth";
 
+/* Days over which the day texture blends into the next month's one */
+#define SEASON_BLEND_DAYS 4
+
+/* Month of a year day, and the number of days left in it */
+static int yearMonth (int yday, int year, float hours, float& left)
+{
+    static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    int start = 0;
+    
+    for (int m = 0; m < 12; m++)
+    {
+	int length = days[m] + ((m == 1 && leap) ? 1 : 0);
+	
+	if (yday < start + length)
+	{
+	    left = start + length - yday - hours / 24;
+	    return m;
+	}
+	start += length;
+    }
+    left = 0;
+    return 11;
+}
+
 void EarthScreen::optionChange (CompOption *option, Options num)
 {
     switch (num)
@@ -69,25 +96,46 @@ void EarthScreen::preparePaint (int ms)
     dec = 23.4400f * cos((6.2831f/365.0000f)*((float)currenttime->tm_yday+10.0000f));
     gha = (float)currenttime->tm_hour-(optionGetTimezone() + (float)currenttime->tm_isdst) + (float)currenttime->tm_min/60.0000f;
     
+    /* Seasonal day texture */
+    updateSeason (currenttime);
+    
     /* Realtime cloudmap */
     res = stat (cloudsfile.filename.c_str(), &attrib);
-    if (((difftime (timer, attrib.st_mtime) > (3600 * updateTime)) || (res != 0)) && (cloudsthreaddata.started == 0) && optionGetClouds())
+    if (((difftime (timer, attrib.st_mtime) > (3600 * updateTime)) || (res != 0)) && (cloudsthreaddata.started == 0) && !imagedata[CLOUDS].image && optionGetClouds())
     {
 	cloudsthreaddata.s = screen;
-		//DownloadClouds_t(&cloudsthreaddata);
+	cloudsthreaddata.resolution = cloudsResolution ();
+	cloudsthreaddata.history = optionGetCloudHistory ();
+	cloudsthreaddata.started = 1;
 	pthread_create (&cloudsthreaddata.tid, NULL, &DownloadClouds_t, (void*) &cloudsthreaddata);
     }
     
     if (cloudsthreaddata.finished == 1)
     {
 	pthread_join (cloudsthreaddata.tid, NULL);
-	TransformClouds (screen);
-	CompString imageFileName="clouds.png", pname="earth";
-	CompSize mSkySize(128, 128);
-	tex[CLOUDS] = GLTexture::readImageToTexture(imageFileName,pname,mSkySize);
 	cloudsthreaddata.finished = 0;
 	cloudsthreaddata.started = 0;
+	
+	/* The download thread stays away from compiz, its failure is reported here */
+	if (cloudsthreaddata.error[0])
+	    compLogMessage ("earth", CompLogLevelWarn, "unable to decode the cloudmap: %s", cloudsthreaddata.error);
+    }
+    
+    /* Interpolate from the previous cloudmap to the newest one over the update time */
+    if (optionGetCloudCrossfade () && shadersupport && optionGetShaders () && !cloudsupload.size[1 - cloudsupload.front].isEmpty ())
+    {
+	cloudsupload.fade = difftime (timer, cloudsupload.time[cloudsupload.front]) / (3600 * updateTime);
+	if (cloudsupload.fade < 0)
+	    cloudsupload.fade = 0;
+	if (cloudsupload.fade > 1)
+	    cloudsupload.fade = 1;
     }
+    else
+	cloudsupload.fade = 1;
+    
+    /* Fill the back cloud texture a few rows at a time, once it is no longer shown */
+    if (imagedata[CLOUDS].image && cloudsthreaddata.started == 0 && cloudsupload.fade >= 1)
+	uploadCloudsBands (optionGetCloudUploadBudget ());
     
     cScreen->preparePaint (ms);
 }
@@ -106,28 +154,52 @@ void EarthScreen::cubePaintInside (const GLScreenPaintAttrib &sAttrib, const GLM
     float ratio = (float)output->height() / output->width();
     if (cubeScreen->multioutputMode() == CubeScreen::Automatic)
 		ratio = (float)screen->height() / screen->width();
+    GLMatrix earthTransform = sTransform;
+    earthTransform.translate (cubeScreen->outputXOffset(), -cubeScreen->outputYOffset(), 0.0f);
+    earthTransform.scale (cubeScreen->outputXScale(), cubeScreen->outputYScale(), 1.0f);
     glPushMatrix();
-    glLoadMatrixf (sTransform.getMatrix());
-    glTranslatef (cubeScreen->outputXOffset(), -cubeScreen->outputYOffset(), 0.0f);
-    glScalef (cubeScreen->outputXScale(), cubeScreen->outputYScale(), 1.0f);
+    glLoadMatrixf (earthTransform.getMatrix());
     // Pushing all the attribs I'm about to modify
-    glPushAttrib (GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT | GL_DEPTH_BUFFER_BIT | GL_LIGHTING_BIT | GL_ENABLE_BIT);
+    glPushAttrib (GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT | GL_DEPTH_BUFFER_BIT | GL_LIGHTING_BIT | GL_ENABLE_BIT | GL_POLYGON_BIT);
     glEnable (GL_DEPTH_TEST); 
+    /* Not part of the attribute stack, disabled again below */
+    if (cubemaps && GLEW_ARB_seamless_cube_map)
+	glEnable (GL_TEXTURE_CUBE_MAP_SEAMLESS);
     glPushMatrix();
     // Actual display
     glEnable (GL_LIGHTING);
     glEnable (GL_LIGHT1);
     glEnable (GL_BLEND);
     glDisable (GL_COLOR_MATERIAL);
-    glScalef (ratio*optionGetEarthSize(),1.0f*optionGetEarthSize(),ratio*optionGetEarthSize());
+    earthTransform.scale (ratio*optionGetEarthSize(),1.0f*optionGetEarthSize(),ratio*optionGetEarthSize());
 	//double x=1.0/ratio/optionGetEarthSize(),y=1.0/optionGetEarthSize();
     //glOrtho (-x,x, y,-y, -x,x);
     PreviousOutput = output->id();
     
     // Earth position according to longitude and latitude
-    glRotatef ((optionGetSouth()?-1:1)*optionGetLatitude()-90, 1, 0, 0);
-    glRotatef ((optionGetSouth()?-1:1)*optionGetLongitude(), 0, 0, 1);
-	glRotatef (optionGetSouth()*180, 0, 1 , 0);
+    earthTransform.rotate ((optionGetSouth()?-1:1)*optionGetLatitude()-90, 1, 0, 0);
+    earthTransform.rotate ((optionGetSouth()?-1:1)*optionGetLongitude(), 0, 0, 1);
+	earthTransform.rotate (optionGetSouth()*180, 0, 1 , 0);
+    glLoadMatrixf (earthTransform.getMatrix());
+    
+    /* The camera is at the origin of the eye space, bring it back to the earth coordinates */
+    const float* m = earthTransform.getMatrix ();
+    GLMatrix inverse = earthTransform;
+    eyevalid = inverse.invert ();
+    if (eyevalid)
+    {
+	const float* im = inverse.getMatrix ();
+	for (int i = 0; i < 3; i++)
+	    eye[i] = im[12 + i] / im[15];
+    }
+    
+    /* A mirroring transform turns the outside of the spheres clockwise on screen */
+    float det = m[0] * (m[5] * m[10] - m[9] * m[6]) -
+		m[4] * (m[1] * m[10] - m[9] * m[2]) +
+		m[8] * (m[1] * m[6] - m[5] * m[2]);
+    backface = (det < 0) ? GL_FRONT : GL_BACK;
+    glEnable (GL_CULL_FACE);
+    glCullFace (backface);
 
     glPushMatrix ();
     
@@ -150,51 +222,102 @@ void EarthScreen::cubePaintInside (const GLScreenPaintAttrib &sAttrib, const GLM
     glMaterialfv(GL_FRONT, GL_SPECULAR, Light[EARTH].specular);
     glMaterialf(GL_FRONT, GL_SHININESS, Light[EARTH].shininess);
 
-	for(uint i=0;i<tex[0].size();i++)
-	{
+    /* Time the earth on the GPU, the result is read a frame later so that it does not stall */
+    bool timing = optionGetDebug () && timequery && !timepending;
+    if (timing)
+	glBeginQuery (GL_TIME_ELAPSED, timequery);
+
     if (shadersupport && optionGetShaders())
     {
 	glUseProgram(prog[EARTH]);
 	
 	glActiveTexture (GL_TEXTURE0);
-	tex[DAY][i]->enable(GLTexture::Good);
+	glBindTexture (maptarget, tex[DAY]);
 	
 	glActiveTexture (GL_TEXTURE1);
-	tex[NIGHT][i]->enable(GLTexture::Good);
+	glBindTexture (maptarget, tex[NIGHT]);
+	
+	glActiveTexture (GL_TEXTURE2);
+	glBindTexture (GL_TEXTURE_2D, lut[TRANSMITTANCE]);
+	
+	glActiveTexture (GL_TEXTURE3);
+	glBindTexture (maptarget, nexttex ? nexttex : tex[DAY]);
 	// Pass the textures to the shader
-        texloc[DAY] = glGetUniformLocation (prog[EARTH], "daytex");
-        texloc[NIGHT] = glGetUniformLocation (prog[EARTH], "nighttex");
         glUniform1i (texloc[DAY], 0);
         glUniform1i (texloc[NIGHT], 1);
+        glUniform1i (earthlutloc, 2);
+        glUniform1i (nextloc, 3);
+        glUniform1f (seasonloc, season);
     }
     else
-	tex[DAY][i]->enable(GLTexture::Good);
+    {
+	/* The equirectangular coordinates are in the second set, used by the second unit */
+	if (maptarget == GL_TEXTURE_2D)
+	    glActiveTexture (GL_TEXTURE1);
+	glEnable (maptarget);
+	glBindTexture (maptarget, tex[DAY]);
+    }
 	
-    glCallList (list[EARTH]);
+    drawPatches (EARTH);
 
     if (shadersupport && optionGetShaders())
     {
 	glUseProgram(0);
-	tex[NIGHT][i]->disable();
+	glActiveTexture (GL_TEXTURE3);
+	glBindTexture (maptarget, 0);
+	glActiveTexture (GL_TEXTURE2);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	glActiveTexture (GL_TEXTURE1);
+	glBindTexture (maptarget, 0);
 	glActiveTexture (GL_TEXTURE0);
-    tex[DAY][i]->disable();
+	glBindTexture (maptarget, 0);
     }
     else
-    tex[DAY][i]->disable();
-	}
+    {
+	glBindTexture (maptarget, 0);
+	glDisable (maptarget);
+	glActiveTexture (GL_TEXTURE0);
+    }
 	
     // Clouds display
     glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     
     glMaterialfv(GL_FRONT, GL_SPECULAR, Light[CLOUDS].specular);
-	foreach(GLTexture* t, tex[CLOUDS])
+    drawClouds ();
+    
+    // Atmosphere display
+    if (useAtmosphere ())
+	drawAtmosphere ();
+    
+    if (timing)
+    {
+	glEndQuery (GL_TIME_ELAPSED);
+	timepending = true;
+    }
+    else if (timepending)
+    {
+	GLint available;
+	glGetQueryObjectiv (timequery, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (available)
 	{
-		t->enable(GLTexture::Good);
-		glCallList (list[CLOUDS]);
-		t->disable();
+	    GLuint64 elapsed;
+	    glGetQueryObjectui64v (timequery, GL_QUERY_RESULT, &elapsed);
+	    timetotal += elapsed / 1000000.0;
+	    timepending = false;
+	    
+	    if (++timeframes == 100)
+	    {
+		compLogMessage ("earth", CompLogLevelInfo, "earth rendering: %.3f ms per frame, atmosphere %s",
+				timetotal / timeframes, useAtmosphere () ? "on" : "off");
+		timeframes = 0;
+		timetotal = 0;
+	    }
 	}
+    }
     
     glDisable (GL_LIGHT1);
+    if (cubemaps && GLEW_ARB_seamless_cube_map)
+	glDisable (GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
     // Restore previous state
     glPopMatrix ();
@@ -212,13 +335,15 @@ void EarthScreen::cubeClearTargetOutput (float xRotate, float vRotate)
     if(cubeScreen->getOption("in")->value().b())
 	{
 		cubeScreen->cubeClearTargetOutput (xRotate, vRotate);
-		GLTexture* t = tex[SKY].front();if(false)
+		if(false)
 		{
 			//glEnable(GL_BLEND);
 			glColor4f(0,0,1,0.5);
-			t->enable(GLTexture::Good);
+			glEnable (GL_TEXTURE_2D);
+			glBindTexture (GL_TEXTURE_2D, tex[SKY]);
 			glCallList (list[SKY]);
-			t->disable();
+			glBindTexture (GL_TEXTURE_2D, 0);
+			glDisable (GL_TEXTURE_2D);
 			//glDisable(GL_BLEND);
 		}
 		return;
@@ -242,12 +367,11 @@ void EarthScreen::cubeClearTargetOutput (float xRotate, float vRotate)
     glRotatef (optionGetLatitude(), 1, 0, 0);
     glRotatef (optionGetLongitude() + 180, 0, 0, 1);
 
-	foreach(GLTexture* t, tex[SKY])
-	{
-		t->enable(GLTexture::Good);
-		glCallList (list[SKY]);
-		t->disable();
-	}
+    glEnable (GL_TEXTURE_2D);
+    glBindTexture (GL_TEXTURE_2D, tex[SKY]);
+    glCallList (list[SKY]);
+    glBindTexture (GL_TEXTURE_2D, 0);
+    glDisable (GL_TEXTURE_2D);
 
     /* Now rotate to the position of the sun */
     glRotatef (-gha*15, 0, 0, 1);
@@ -304,11 +428,30 @@ EarthScreen::EarthScreen (CompScreen *s) :
 	//pthread_create (&TexThreadData[i].tid, NULL, &loadTexture, &TexThreadData[i]);
     }
     
+    /* Seasons initialization, the current month is loaded with the other textures */
+    time_t timer = time (NULL);
+    struct tm* currenttime = localtime (&timer);
+    float left;
+    month[0] = yearMonth (currenttime->tm_yday, currenttime->tm_year + 1900, currenttime->tm_hour, left);
+    month[1] = -1;
+    dayfile = dayFile (month[0]);
+    nexttex = 0;
+    season = 0;
+    seasonthreaddata.s = s;
+    seasonthreaddata.base = this;
+    seasonthreaddata.started = 0;
+    seasonthreaddata.finished = 0;
+    seasonthreaddata.image = NULL;
+    
     /* cloudsfile initialization */
     cloudsfile.filename = Glib::getenv("HOME") + "/.compiz-1/earth/images/clouds.jpg";
     cloudsfile.stream = NULL;
+    ringbase = Glib::getenv("HOME") + "/.compiz-1/earth/images/clouds";
+    cloudsring.map = NULL;
+    cloudsring.header = NULL;
     cloudsthreaddata.started = 0;
     cloudsthreaddata.finished = 0;
+    imagedata[CLOUDS].image = NULL;
     
     /* cURL initialization */
     curl_global_init (CURL_GLOBAL_DEFAULT);
@@ -345,6 +488,9 @@ EarthScreen::EarthScreen (CompScreen *s) :
     /* Display lists creation */
     createLists ();
     
+    /* Atmosphere lookup tables */
+    createAtmosphere ();
+    
     /* Join the texture images loading threads, bind the images to actual textures and free the images data */
     for (int i=0; i<4; i++)
     {
@@ -353,6 +499,7 @@ EarthScreen::EarthScreen (CompScreen *s) :
 	//free(imagedata[i].image);
     }
 	for(int i=0;i<4;i++)loadTexture(&TexThreadData[i]);
+    createCloudsTextures ();
     ChangeNotify optionC = boost::bind(&EarthScreen::optionChange,this,_1,_2);
 	
     /* BCOP */
@@ -365,16 +512,29 @@ EarthScreen::EarthScreen (CompScreen *s) :
 
 EarthScreen::~EarthScreen ()
 {
-    /* Free display list */
-    glDeleteLists (list[0], 4);
+    /* Release display lists, they stay around as long as another screen uses them */
+    cacheReleaseLists (list[0]);
 
-    // /* Free textures data */
-    //for (int i=0; i<4; i++)
-	//	foreach(GLTexture t,tex[i])
-	//		t.destroyTexture ();
+    /* Release textures */
+    for (int i=0; i<4; i++)
+	if (i != CLOUDS)
+	    cacheReleaseTexture (tex[i]);
     
-    /* Detach and free shaders */
+    if (seasonthreaddata.started)
+	pthread_join (seasonthreaddata.tid, NULL);
+    cacheReleaseImage (seasonthreaddata.image);
+    if (nexttex)
+	cacheReleaseTexture (nexttex);
+    
+    /* Release shaders and lookup tables */
     deleteShaders ();
+    deleteAtmosphere ();
+    
+    /* Free the cloud textures and any pending cloudmap */
+    if (cloudsthreaddata.started)
+	pthread_join (cloudsthreaddata.tid, NULL);
+    deleteCloudsTextures ();
+    cloudsRingClose (&cloudsring);
     
     /* cURL cleanup */
     if (curlhandle)
@@ -382,7 +542,11 @@ EarthScreen::~EarthScreen ()
     curl_global_cleanup ();
 }
 
-void EarthScreen::makeSphere (GLdouble radius, GLboolean inside)
+/* With cube, the texture coordinates of the outer sphere are the directions used to sample a cubemap,
+ * and the equirectangular ones go in the second set.
+ * Only the quads from row and column on are made, out of 64 both ways */
+void EarthScreen::makeSphere (GLdouble radius, GLboolean inside, GLboolean cube,
+			      GLint row, GLint rows, GLint column, GLint columns)
 {
     GLfloat sinCache1a[65];
     GLfloat cosCache1a[65];
@@ -430,7 +594,7 @@ void EarthScreen::makeSphere (GLdouble radius, GLboolean inside)
     sinCache2a[64] = sinCache2a[0];
     cosCache2a[64] = cosCache2a[0];
 
-    for (GLint j = 0; j < 64; j++)
+    for (GLint j = row; j < row + rows; j++)
     {
         zLow = cosCache1b[j];
         zHigh = cosCache1b[j+1];
@@ -453,12 +617,18 @@ void EarthScreen::makeSphere (GLdouble radius, GLboolean inside)
 	    costemp4 = cosCache2b[j+1];
 	}
         glBegin (GL_QUAD_STRIP);
-	    for (int i = 0; i <= 64; i++)
+	    for (int i = column; i <= column + columns; i++)
 	    {
 		glNormal3f(sinCache2a[i] * sintemp3, cosCache2a[i] * sintemp3, costemp3);
 		if (!inside)
 		{
-		    glTexCoord2f(1-(float) i / 64, (float) (j+1) / 64);
+		    if (cube)
+		    {
+			glTexCoord3f(sinCache2a[i] * sintemp3, cosCache2a[i] * sintemp3, costemp3);
+			glMultiTexCoord2f(GL_TEXTURE1, 1-(float) i / 64, (float) (j+1) / 64);
+		    }
+		    else
+			glTexCoord2f(1-(float) i / 64, (float) (j+1) / 64);
 		    glVertex3f(sintemp2 * sinCache1a[i], sintemp2 * cosCache1a[i], zHigh);
 		}
 		else
@@ -470,7 +640,13 @@ void EarthScreen::makeSphere (GLdouble radius, GLboolean inside)
 		glNormal3f(sinCache2a[i] * sintemp4, cosCache2a[i] * sintemp4, costemp4);
 		if (!inside)
 		{
-		    glTexCoord2f(1-(float) i / 64, (float) j / 64);
+		    if (cube)
+		    {
+			glTexCoord3f(sinCache2a[i] * sintemp4, cosCache2a[i] * sintemp4, costemp4);
+			glMultiTexCoord2f(GL_TEXTURE1, 1-(float) i / 64, (float) j / 64);
+		    }
+		    else
+			glTexCoord2f(1-(float) i / 64, (float) j / 64);
 		    glVertex3f(sintemp1 * sinCache1a[i], sintemp1 * cosCache1a[i], zLow);
 		}
 		else
@@ -485,15 +661,14 @@ void EarthScreen::makeSphere (GLdouble radius, GLboolean inside)
 
 CompString LoadSource (const char* filename)
 {
-    CompString src;   /* shader source code */
     std::ifstream fi(filename);    /* file */
     if (!fi.is_open())
     {
 	compLogMessage("earth",CompLogLevelError,"unable to load '%s'", filename);
-        return NULL;
+        return "";
     }
-    while(fi)
-		fi>>src;
+    /* shader source code, whitespace and newlines included */
+    CompString src ((std::istreambuf_iterator<char> (fi)), std::istreambuf_iterator<char> ());
 	fi.close();
     return src;
 }
@@ -508,12 +683,193 @@ void* loadTexture (void* p)
     
     switch (num)
     {
-		   case DAY:	texfile+="day.png";	break;
+		   case DAY:	texfile=threaddata->base->dayfile;	break;
 		   case NIGHT:	texfile+="night.png";	break;
 		   case SKY:	texfile+="skydome.png";	break;
 		   case CLOUDS:	texfile+="clouds.png";	break;
     }
-    threaddata->base->tex[num] = GLTexture::readImageToTexture(texfile,pname,threaddata->base->imagedata[num].size);
+    /* Clouds are kept as raw alpha data, they go in the double-buffered textures */
+    if (num == CLOUDS)
+    {
+	EarthScreen* es = threaddata->base;
+	
+	/* The newest processed cloudmaps are mapped from the history of this size, no decoding,
+	 * unless the downloaded cloudmap is newer, when a previous push did not make it */
+	struct stat attrib;
+	int width, height;
+	time_t newest;
+	if (stat (es->cloudsfile.filename.c_str (), &attrib) == 0 &&
+	    cloudsSize (es->cloudsfile.filename.c_str (), es->cloudsResolution (), &width, &height) &&
+	    cloudsRingOpen (&es->cloudsring, cloudsRingFile (es->ringbase, es->optionGetCloudHistory (), width, height).c_str (),
+			    es->optionGetCloudHistory ()) &&
+	    cloudsRingEntry (&es->cloudsring, 0, &newest) && newest >= attrib.st_mtime)
+	{
+	    es->imagedata[num].image = NULL;
+	    return NULL;
+	}
+	
+	char message[CLOUDS_ERROR_LENGTH];
+	if (TransformClouds (es->cloudsfile.filename.c_str (), es->cloudsResolution (), es->imagedata[num].image, es->imagedata[num].size, message))
+	{
+	    es->cloudsupload.pending = (stat (es->cloudsfile.filename.c_str (), &attrib) == 0) ? attrib.st_mtime : time (NULL);
+	    CompSize& size = es->imagedata[num].size;
+	    cloudsRingPush (&es->cloudsring, cloudsRingFile (es->ringbase, es->optionGetCloudHistory (),
+							     size.width (), size.height ()).c_str (),
+			    es->optionGetCloudHistory (), (unsigned char*) es->imagedata[num].image,
+			    size.width (), size.height (), es->cloudsupload.pending);
+	    return NULL;
+	}
+	if (message[0])
+	    compLogMessage ("earth", CompLogLevelWarn, "unable to decode the cloudmap: %s", message);
+	
+	/* No downloaded cloudmap yet, fall back to the default one and keep its alpha channel */
+	void* image;
+	CompSize size;
+	if (!threaddata->s->readImageFromFile (texfile, pname, size, image))
+	{
+	    es->imagedata[num].image = NULL;
+	    return NULL;
+	}
+	
+	unsigned char* rgba = (unsigned char*) image;
+	unsigned char* alpha = (unsigned char*) malloc (size.width () * size.height ());
+	for (int i = 0; i < size.width () * size.height (); i++)
+	    #if __BYTE_ORDER == __BIG_ENDIAN
+	    alpha[i] = rgba[i * 4 + 0];
+	    #else
+	    alpha[i] = rgba[i * 4 + 3];
+	    #endif
+	free (image);
+	
+	es->imagedata[num].image = alpha;
+	es->imagedata[num].size = size;
+	es->cloudsupload.pending = 0;
+	return NULL;
+    }
+    /* Decoded once per source, the texture is shared with the other screens */
+    if (num == DAY || num == NIGHT)
+	threaddata->base->tex[num] = threaddata->base->acquireMap (texfile);
+    else
+	threaddata->base->tex[num] = cacheAcquireTexture (texfile, "", loadImage, threaddata->s);
+    return NULL;
+}
+
+void* loadImage (const CompString& source, CachedImage* image, void* closure)
+{
+    CompScreen* s = (CompScreen*) closure;
+    CompString file = source;
+    void* data;
+    
+    if (!s->readImageFromFile (file, pname, image->size, data))
+	return NULL;
+    
+    image->channels = 4;
+    image->faces = 1;
+    return data;
+}
+
+/* Day and night maps, as cubemaps or as they are */
+GLuint EarthScreen::acquireMap (const CompString& file)
+{
+    if (cubemaps)
+	return cacheAcquireTexture (file, "cube", loadCubeImage, screen);
+    return cacheAcquireTexture (file, "", loadImage, screen);
+}
+
+/* Mesa rasterizing on the CPU, where the automatic options pick the cheaper rendering */
+bool EarthScreen::softwareRenderer ()
+{
+    const char* renderer = (const char*) glGetString (GL_RENDERER);
+    
+    return renderer && (strstr (renderer, "llvmpipe") || strstr (renderer, "softpipe") ||
+			strstr (renderer, "Software Rasterizer") || strstr (renderer, "swrast"));
+}
+
+/* Cubemaps spend the texels evenly over the globe, but software renderers sample them
+ * much more slowly than the equirectangular maps */
+bool EarthScreen::useCubemaps ()
+{
+    if (!GLEW_ARB_texture_cube_map)
+	return false;
+    
+    switch (optionGetProjection ())
+    {
+	case ProjectionCubemaps:	return true;
+	case ProjectionEquirectangular:	return false;
+    }
+    
+    return !software;
+}
+
+/* The atmosphere shell about doubles the cost of the earth on software renderers */
+bool EarthScreen::useAtmosphere ()
+{
+    if (!shadersupport || !optionGetShaders ())
+	return false;
+    
+    switch (optionGetAtmosphere ())
+    {
+	case AtmosphereOn:	return true;
+	case AtmosphereOff:	return false;
+    }
+    
+    return !software;
+}
+
+/* Off the main thread the maps are decoded with libpng instead of compiz,
+ * closure is then a PNG_ERROR_LENGTH buffer for the reason of a failure */
+void* loadPngImage (const CompString& source, CachedImage* image, void* closure)
+{
+    int width, height;
+    void* data = decodePng (source.c_str (), &width, &height, true, (char*) closure);
+    
+    if (!data)
+	return NULL;
+    
+    image->size = CompSize (width, height);
+    image->channels = 4;
+    image->faces = 1;
+    return data;
+}
+
+/* Reprojects an equirectangular map to a cubemap, so the poles do not waste texels */
+static void* cubeImage (void* data, CachedImage* image)
+{
+    if (!data)
+	return NULL;
+    
+    int size = cubeFaceSize (image->size.width ());
+    unsigned char* cube = (unsigned char*) malloc ((size_t) 6 * size * size * 4);
+    
+    reprojectCube ((unsigned char*) data, image->size.width (), image->size.height (), 4, cube, size);
+    free (data);
+    
+    image->size = CompSize (size, size);
+    image->faces = 6;
+    return cube;
+}
+
+void* loadCubeImage (const CompString& source, CachedImage* image, void* closure)
+{
+    return cubeImage (loadImage (source, image, closure), image);
+}
+
+void* loadPngCubeImage (const CompString& source, CachedImage* image, void* closure)
+{
+    return cubeImage (loadPngImage (source, image, closure), image);
+}
+
+void* PrefetchSeason_t (void* threaddata)
+{
+    EarthScreen::SeasonThreadData* data = (EarthScreen::SeasonThreadData*) threaddata;
+    
+    /* Decode and reproject without compiz, the texture is made from the cached image on the main thread */
+    if (data->base->cubemaps)
+	data->image = cacheAcquireImage (data->file, "cube", loadPngCubeImage, data->error);
+    else
+	data->image = cacheAcquireImage (data->file, "", loadPngImage, data->error);
+    
+    data->finished = 1;
     return NULL;
 }
 
@@ -524,6 +880,7 @@ void* DownloadClouds_t (void* threaddata)
     
     data->started = 1;
     data->finished = 0;
+    data->error[0] = 0;
     
     /* cloudsfile initialization */
     data->base->cloudsfile.stream = NULL;
@@ -533,7 +890,26 @@ void* DownloadClouds_t (void* threaddata)
 	curl_easy_perform (data->base->curlhandle);
     
     if (data->base->cloudsfile.stream)
+    {
 	fclose(data->base->cloudsfile.stream);
+	
+	/* Decode and transform in this thread, the main one only uploads the result */
+	void* image;
+	CompSize size;
+	if (TransformClouds (data->base->cloudsfile.filename.c_str (), data->resolution, image, size, data->error))
+	{
+	    time_t now = time (NULL);
+	    
+	    /* Keep it in the history for the next start */
+	    cloudsRingPush (&data->base->cloudsring,
+			    cloudsRingFile (data->base->ringbase, data->history, size.width (), size.height ()).c_str (),
+			    data->history, (unsigned char*) image, size.width (), size.height (), now);
+	    
+	    data->base->cloudsupload.pending = now;
+	    data->base->imagedata[CLOUDS].size = size;
+	    data->base->imagedata[CLOUDS].image = image;
+	}
+    }
     
     data->finished = 1;
     return NULL;
@@ -543,60 +919,415 @@ void EarthScreen::createShaders ()
 {
     /* Shader support */
     glewInit ();
-    if (glewIsSupported ("GL_VERSION_2_0"))
-	shadersupport = GL_TRUE;
+    shadersupport = glewIsSupported ("GL_VERSION_2_0");
+    software = softwareRenderer ();
+    cubemaps = useCubemaps ();
+    maptarget = cubemaps ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
     
     if (shadersupport)
     {
-	/* Shader creation, loading and compiling */
-	vert[EARTH] = glCreateShader (GL_VERTEX_SHADER);
-	frag[EARTH] = glCreateShader (GL_FRAGMENT_SHADER);
+	/* Compiled once per GL context */
+	prog[EARTH] = cacheAcquireProgram ("earth", cubemaps ? "" : "#define EQUIRECT\n");
+	prog[CLOUDS] = cacheAcquireProgram ("clouds");
+	prog[ATMOSPHERE] = cacheAcquireProgram ("atmosphere");
 	
-	vertfile[EARTH] += Glib::getenv("HOME") + "/.compiz-1/earth/data/earth.vert";
-	fragfile[EARTH] += Glib::getenv("HOME") + "/.compiz-1/earth/data/earth.frag";
-		
-	vertsource[EARTH] = LoadSource (vertfile[EARTH].c_str());
-	fragsource[EARTH] = LoadSource (fragfile[EARTH].c_str());
+	texloc[DAY] = glGetUniformLocation (prog[EARTH], "daytex");
+	texloc[NIGHT] = glGetUniformLocation (prog[EARTH], "nighttex");
+	texloc[CLOUDS] = glGetUniformLocation (prog[CLOUDS], "cloudstex");
+	oldloc = glGetUniformLocation (prog[CLOUDS], "oldtex");
+	fadeloc = glGetUniformLocation (prog[CLOUDS], "fade");
+	earthlutloc = glGetUniformLocation (prog[EARTH], "transmittance");
+	nextloc = glGetUniformLocation (prog[EARTH], "nexttex");
+	seasonloc = glGetUniformLocation (prog[EARTH], "season");
+	lutloc = glGetUniformLocation (prog[ATMOSPHERE], "scattering");
+	radiiloc = glGetUniformLocation (prog[ATMOSPHERE], "radii");
+    }
+}
 
-	const char*c=vertsource[EARTH].c_str();
-	glShaderSource (vert[EARTH], 1, &c, NULL);
-	c=fragsource[EARTH].c_str();
-	glShaderSource (frag[EARTH], 1, &c, NULL);
+void EarthScreen::deleteShaders ()
+{
+    if (shadersupport)
+    {
+	cacheReleaseProgram (prog[EARTH]);
+	cacheReleaseProgram (prog[CLOUDS]);
+	cacheReleaseProgram (prog[ATMOSPHERE]);
+    }
+}
+
+void EarthScreen::createCloudsTextures ()
+{
+    cloudsupload.front = 0;
+    cloudsupload.row = 0;
+    cloudsupload.fade = 1;
+    cloudsupload.time[0] = cloudsupload.time[1] = 0;
+    cloudsupload.pbo = 0;
+    
+    glGenTextures (2, cloudsupload.tex);
+    for (int i=0; i<2; i++)
+    {
+	glBindTexture (GL_TEXTURE_2D, cloudsupload.tex[i]);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	cloudsupload.size[i] = CompSize (0, 0);
+    }
+    glBindTexture (GL_TEXTURE_2D, 0);
+    
+    if (GLEW_ARB_pixel_buffer_object)
+	glGenBuffers (1, &cloudsupload.pbo);
+    
+    /* The newest cloudmap from the history goes to the front texture, the previous one to the back */
+    time_t t;
+    const unsigned char* newest = cloudsRingEntry (&cloudsring, 0, &t);
+    
+    /* Unless a newer cloudmap decoded at startup could not be pushed */
+    if (newest && imagedata[CLOUDS].image && t < cloudsupload.pending)
+	newest = NULL;
+    if (newest)
+    {
+	CompSize size (cloudsring.header->width, cloudsring.header->height);
 	
+	uploadClouds (0, newest, size, t);
 	
-	glCompileShader (vert[EARTH]);
-	glCompileShader (frag[EARTH]);
+	const unsigned char* previous = cloudsRingEntry (&cloudsring, 1, &t);
+	if (previous)
+	    uploadClouds (1, previous, size, t);
 	
-	/* Program creation, attaching and linking */
-	prog[EARTH] = glCreateProgram ();
+	/* A cloudmap decoded at startup is already in the history */
+	if (imagedata[CLOUDS].image)
+	{
+	    free (imagedata[CLOUDS].image);
+	    imagedata[CLOUDS].image = NULL;
+	}
+    }
+    
+    /* Otherwise the cloudmap loaded at startup goes straight to the front texture */
+    else if (imagedata[CLOUDS].image)
+    {
+	cloudsupload.front = 1;
+	uploadCloudsBands (-1);
+    }
+}
+
+void EarthScreen::uploadClouds (int index, const unsigned char* data, CompSize size, time_t stamp)
+{
+    glBindTexture (GL_TEXTURE_2D, cloudsupload.tex[index]);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_ALPHA8, size.width (), size.height (), 0, GL_ALPHA, GL_UNSIGNED_BYTE, data);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture (GL_TEXTURE_2D, 0);
+    
+    cloudsupload.size[index] = size;
+    cloudsupload.time[index] = stamp;
+}
+
+void EarthScreen::deleteCloudsTextures ()
+{
+    glDeleteTextures (2, cloudsupload.tex);
+    if (cloudsupload.pbo)
+	glDeleteBuffers (1, &cloudsupload.pbo);
+    
+    if (imagedata[CLOUDS].image)
+	free (imagedata[CLOUDS].image);
+    imagedata[CLOUDS].image = NULL;
+}
+
+/* Upload bands of the pending cloudmap to the back texture for at most budget ms
+ * (everything if budget is negative), and swap the textures once it is complete */
+void EarthScreen::uploadCloudsBands (float budget)
+{
+    const int band = 32;
+    int back = 1 - cloudsupload.front;
+    int width = imagedata[CLOUDS].size.width ();
+    int height = imagedata[CLOUDS].size.height ();
+    const char* data = (const char*) imagedata[CLOUDS].image;
+    struct timespec start, now;
+    
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    
+    glBindTexture (GL_TEXTURE_2D, cloudsupload.tex[back]);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+    
+    if (cloudsupload.row == 0 && cloudsupload.size[back] != imagedata[CLOUDS].size)
+    {
+	glTexImage2D (GL_TEXTURE_2D, 0, GL_ALPHA8, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+	cloudsupload.size[back] = imagedata[CLOUDS].size;
+    }
+    
+    if (cloudsupload.pbo)
+	glBindBuffer (GL_PIXEL_UNPACK_BUFFER, cloudsupload.pbo);
+    
+    while (cloudsupload.row < height)
+    {
+	int rows = MIN (band, height - cloudsupload.row);
+	const char* src = data + cloudsupload.row * width;
 	
-	glAttachShader (prog[EARTH], vert[EARTH]);
-	glAttachShader (prog[EARTH], frag[EARTH]);
+	if (cloudsupload.pbo)
+	{
+	    /* Orphan the previous band so the driver does not have to wait for it */
+	    glBufferData (GL_PIXEL_UNPACK_BUFFER, rows * width, NULL, GL_STREAM_DRAW);
+	    glBufferSubData (GL_PIXEL_UNPACK_BUFFER, 0, rows * width, src);
+	    src = NULL;
+	}
+	glTexSubImage2D (GL_TEXTURE_2D, 0, 0, cloudsupload.row, width, rows, GL_ALPHA, GL_UNSIGNED_BYTE, src);
+	cloudsupload.row += rows;
 	
-	glLinkProgram (prog[EARTH]);
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	if (budget >= 0 && (now.tv_sec - start.tv_sec) * 1000.0f + (now.tv_nsec - start.tv_nsec) / 1000000.0f > budget)
+	    break;
     }
+    
+    if (cloudsupload.pbo)
+	glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture (GL_TEXTURE_2D, 0);
+    
+    if (cloudsupload.row < height)
+	return;
+    
+    /* Complete, swap and start interpolating from the old map */
+    cloudsupload.time[back] = cloudsupload.pending;
+    cloudsupload.front = back;
+    cloudsupload.row = 0;
+    
+    free (imagedata[CLOUDS].image);
+    imagedata[CLOUDS].image = NULL;
 }
 
-void EarthScreen::deleteShaders ()
+/* Monthly day map, day01.png to day12.png, or the yearly day.png */
+CompString EarthScreen::dayFile (int month)
 {
-    if (shadersupport)
+    CompString dir = Glib::getenv("HOME") + "/.compiz-1/earth/images/";
+    CompString file = dir + compPrintf ("day%02d.png", month + 1);
+    struct stat attrib;
+    
+    if (stat (file.c_str (), &attrib) == 0)
+	return file;
+    return dir + "day.png";
+}
+
+/* Keeps the current and the next month resident, the next one is prefetched
+ * in the background a little before the blend towards it starts */
+void EarthScreen::updateSeason (struct tm* t)
+{
+    float left;
+    int current = yearMonth (t->tm_yday, t->tm_year + 1900, t->tm_hour + t->tm_min / 60.0f, left);
+    
+    if (current != month[0])
     {
-	glDetachShader(prog[EARTH], vert[EARTH]);
-	glDetachShader(prog[EARTH], frag[EARTH]);
+	CompString old = dayfile;
 	
-	glDeleteShader(vert[EARTH]);
-	glDeleteShader(frag[EARTH]);
+	if (seasonthreaddata.started)
+	{
+	    pthread_join (seasonthreaddata.tid, NULL);
+	    seasonthreaddata.started = 0;
+	    seasonthreaddata.finished = 0;
+	}
+	cacheReleaseImage (seasonthreaddata.image);
+	seasonthreaddata.image = NULL;
 	
-	glDeleteProgram(prog[EARTH]);
+	/* The prefetched month becomes the current one, unless the clock jumped,
+	 * and the map stays when both months share it */
+	if (nexttex && month[1] == current)
+	{
+	    cacheReleaseTexture (tex[DAY]);
+	    tex[DAY] = nexttex;
+	}
+	else
+	{
+	    if (nexttex)
+		cacheReleaseTexture (nexttex);
+	    if (dayFile (current) != old)
+	    {
+		cacheReleaseTexture (tex[DAY]);
+		tex[DAY] = acquireMap (dayFile (current));
+	    }
+	}
+	nexttex = 0;
+	month[0] = current;
+	month[1] = -1;
+	dayfile = dayFile (current);
+	
+	/* The previous month will not be needed before next year */
+	if (old != dayfile)
+	    cacheDiscardImage (old, cubemaps ? "cube" : "");
     }
+    
+    /* Tried once a month, and only when the next month has its own map */
+    if (month[1] < 0 && seasonthreaddata.started == 0 && left < SEASON_BLEND_DAYS + 1)
+    {
+	month[1] = (current + 1) % 12;
+	seasonthreaddata.file = dayFile (month[1]);
+	if (seasonthreaddata.file != dayfile)
+	{
+	    seasonthreaddata.started = 1;
+	    pthread_create (&seasonthreaddata.tid, NULL, &PrefetchSeason_t, (void*) &seasonthreaddata);
+	}
+    }
+    
+    if (seasonthreaddata.finished == 1)
+    {
+	pthread_join (seasonthreaddata.tid, NULL);
+	seasonthreaddata.finished = 0;
+	seasonthreaddata.started = 0;
+	
+	/* The image is already decoded, this only uploads it */
+	if (seasonthreaddata.image)
+	{
+	    nexttex = acquireMap (seasonthreaddata.file);
+	    cacheReleaseImage (seasonthreaddata.image);
+	    seasonthreaddata.image = NULL;
+	}
+	else
+	    compLogMessage ("earth", CompLogLevelWarn, "unable to load %s: %s",
+			    seasonthreaddata.file.c_str (), seasonthreaddata.error);
+    }
+    
+    season = nexttex ? 1 - left / SEASON_BLEND_DAYS : 0;
+    if (season < 0)
+	season = 0;
+    if (season > 1)
+	season = 1;
 }
 
-void EarthScreen::createLists ()
+/* Number of pixels around the on-screen equator, the cloudmap needs no more texels than that */
+int EarthScreen::cloudsResolution ()
+{
+    return M_PI * screen->height () * optionGetEarthSize ();
+}
+
+void EarthScreen::drawClouds ()
+{
+    if (cloudsupload.size[cloudsupload.front].isEmpty ())
+	return;
+    
+    if (cloudsupload.fade < 1)
+    {
+	/* Crossfade between both maps on the GPU */
+	glUseProgram (prog[CLOUDS]);
+	
+	glActiveTexture (GL_TEXTURE1);
+	glBindTexture (GL_TEXTURE_2D, cloudsupload.tex[1 - cloudsupload.front]);
+	glActiveTexture (GL_TEXTURE0);
+	glBindTexture (GL_TEXTURE_2D, cloudsupload.tex[cloudsupload.front]);
+	
+	glUniform1i (texloc[CLOUDS], 0);
+	glUniform1i (oldloc, 1);
+	glUniform1f (fadeloc, cloudsupload.fade);
+	
+	drawPatches (CLOUDS);
+	
+	glUseProgram (0);
+	glActiveTexture (GL_TEXTURE1);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	glActiveTexture (GL_TEXTURE0);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	return;
+    }
+    
+    glEnable (GL_TEXTURE_2D);
+    glBindTexture (GL_TEXTURE_2D, cloudsupload.tex[cloudsupload.front]);
+    drawPatches (CLOUDS);
+    glBindTexture (GL_TEXTURE_2D, 0);
+    glDisable (GL_TEXTURE_2D);
+}
+
+void* loadTransmittance (const CompString& source, CachedImage* image, void* closure)
+{
+    unsigned short* data = (unsigned short*) malloc (ATMOSPHERE_TRANSMITTANCE_WIDTH * ATMOSPHERE_TRANSMITTANCE_HEIGHT * 8);
+    
+    computeTransmittance (data);
+    
+    image->size = CompSize (ATMOSPHERE_TRANSMITTANCE_WIDTH, ATMOSPHERE_TRANSMITTANCE_HEIGHT);
+    image->channels = 8;
+    image->faces = 1;
+    return data;
+}
+
+void* loadScattering (const CompString& source, CachedImage* image, void* closure)
+{
+    unsigned short* data = (unsigned short*) malloc (ATMOSPHERE_SCATTERING_WIDTH * ATMOSPHERE_SCATTERING_HEIGHT * 8);
+    
+    computeScattering (data);
+    
+    image->size = CompSize (ATMOSPHERE_SCATTERING_WIDTH, ATMOSPHERE_SCATTERING_HEIGHT);
+    image->channels = 8;
+    image->faces = 1;
+    return data;
+}
+
+void EarthScreen::createAtmosphere ()
+{
+    lut[TRANSMITTANCE] = lut[SCATTERING] = 0;
+    timequery = 0;
+    timepending = false;
+    timeframes = 0;
+    timetotal = 0;
+    
+    if (!shadersupport)
+	return;
+    
+    /* Computed on all cores the first time, then mapped from the cache */
+    lut[TRANSMITTANCE] = cacheAcquireTexture ("", ATMOSPHERE_TRANSMITTANCE_VARIANT, loadTransmittance, NULL);
+    lut[SCATTERING] = cacheAcquireTexture ("", ATMOSPHERE_SCATTERING_VARIANT, loadScattering, NULL);
+    
+    if (GLEW_ARB_timer_query)
+	glGenQueries (1, &timequery);
+}
+
+void EarthScreen::deleteAtmosphere ()
+{
+    if (!shadersupport)
+	return;
+    
+    cacheReleaseTexture (lut[TRANSMITTANCE]);
+    cacheReleaseTexture (lut[SCATTERING]);
+    
+    if (timequery)
+	glDeleteQueries (1, &timequery);
+}
+
+/* Additive shell around the earth, only the front faces so each ray is counted once */
+void EarthScreen::drawAtmosphere ()
+{
+    glPushAttrib (GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT | GL_POLYGON_BIT);
+    glEnable (GL_CULL_FACE);
+    glCullFace (backface);
+    glDepthMask (GL_FALSE);
+    glBlendFunc (GL_ONE, GL_ONE);
+    
+    glUseProgram (prog[ATMOSPHERE]);
+    glBindTexture (GL_TEXTURE_2D, lut[SCATTERING]);
+    glUniform1i (lutloc, 0);
+    glUniform2f (radiiloc, EARTH_RADIUS, EARTH_RADIUS * ATMOSPHERE_RT / ATMOSPHERE_RG);
+    
+    glCallList (list[ATMOSPHERE]);
+    
+    glUseProgram (0);
+    glBindTexture (GL_TEXTURE_2D, 0);
+    glPopAttrib ();
+}
+
+static void buildLists (GLuint base, int count, void* closure)
 {
-    int i;
-    list[0] = glGenLists (4);
+    EarthScreen* es = (EarthScreen*) closure;
+    GLint rows = 64 / PATCH_ROWS, columns = 64 / PATCH_COLUMNS;
     
-    for (i=0; i<4; i++)
+    /* Earth and clouds patches, after the 5 spheres */
+    for (int p=0; p<SPHERE_PATCHES; p++)
+    {
+	GLint row = p / PATCH_COLUMNS * rows, column = p % PATCH_COLUMNS * columns;
+	
+	glNewList (base + 5 + p, GL_COMPILE);
+	    es->makeSphere (EARTH_RADIUS, FALSE, TRUE, row, rows, column, columns);
+	glEndList ();
+	glNewList (base + 5 + SPHERE_PATCHES + p, GL_COMPILE);
+	    es->makeSphere (CLOUDS_RADIUS, FALSE, FALSE, row, rows, column, columns);
+	glEndList ();
+    }
+    
+    for (int i=0; i<5; i++)
     {
 	GLdouble radius;
 	GLboolean inside;
@@ -604,19 +1335,135 @@ void EarthScreen::createLists ()
 	switch (i)
 	{
 	    case SUN:	    radius = 0.1;	inside = TRUE;	break;
-	    case EARTH:	    radius = 0.89;	inside = FALSE;	break;
-	    case CLOUDS:	radius = 0.9;	inside = FALSE;	break;
+	    case EARTH:	    radius = EARTH_RADIUS;	inside = FALSE;	break;
+	    case CLOUDS:	radius = CLOUDS_RADIUS;	inside = FALSE;	break;
 	    case SKY:	    radius = 10;	inside = TRUE;	break;
+	    case ATMOSPHERE:	radius = EARTH_RADIUS * ATMOSPHERE_RT / ATMOSPHERE_RG;	inside = FALSE;	break;
 	}
 	
-	list[i] = list[0] + i;
 	//if(cubeScreen->getOption("in")->value().b() && (i == EARTH || i == CLOUDS)) {radius = 3 - radius ;inside=true;}
-	glNewList (list[i], GL_COMPILE);
-	    makeSphere (radius, inside);
+	glNewList (base + i, GL_COMPILE);
+	    /* The whole earth and clouds are their patches */
+	    if (i == EARTH || i == CLOUDS)
+		for (int p=0; p<SPHERE_PATCHES; p++)
+		    glCallList (base + 5 + (i == CLOUDS) * SPHERE_PATCHES + p);
+	    else
+		es->makeSphere (radius, inside);
 	glEndList ();
     }
 }
 
+/* Cone around the vertex directions of each patch, the same for every sphere */
+static void makePatches (SpherePatch* patches)
+{
+    GLint rows = 64 / PATCH_ROWS, columns = 64 / PATCH_COLUMNS;
+    
+    for (int p=0; p<SPHERE_PATCHES; p++)
+    {
+	GLint row = p / PATCH_COLUMNS * rows, column = p % PATCH_COLUMNS * columns;
+	GLfloat* axis = patches[p].axis;
+	GLfloat cosmin = 1;
+	
+	axis[0] = axis[1] = axis[2] = 0;
+	for (int pass=0; pass<2; pass++)
+	{
+	    for (int j=row; j<=row+rows; j++)
+	    {
+		for (int i=column; i<=column+columns; i++)
+		{
+		    /* Same directions as makeSphere */
+		    GLfloat theta = M_PI * j / 64, phi = 2 * M_PI * i / 64;
+		    GLfloat d[3] = { sinf (theta) * sinf (phi), sinf (theta) * cosf (phi), cosf (theta) };
+		    
+		    if (pass == 0)
+			for (int k=0; k<3; k++)
+			    axis[k] += d[k];
+		    else
+			cosmin = MIN (cosmin, axis[0] * d[0] + axis[1] * d[1] + axis[2] * d[2]);
+		}
+	    }
+	    
+	    if (pass == 0)
+	    {
+		GLfloat length = sqrtf (axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		for (int k=0; k<3; k++)
+		    axis[k] /= length;
+	    }
+	}
+	patches[p].angle = acosf (MAX (-1.0f, MIN (1.0f, cosmin)));
+    }
+}
+
+void EarthScreen::createLists ()
+{
+    /* The spheres are the same for every screen */
+    list[0] = cacheAcquireLists ("spheres", 5 + 2 * SPHERE_PATCHES, buildLists, this);
+    
+    for (int i=0; i<5; i++)
+	list[i] = list[0] + i;
+    
+    makePatches (patches);
+    eyevalid = false;
+    backface = GL_BACK;
+    cullframes = 0;
+    culltotal = 0;
+}
+
+static bool patchNearer (const std::pair<GLfloat, int>& a, const std::pair<GLfloat, int>& b)
+{
+    return a.first < b.first;
+}
+
+/* Draws the patches of the earth or the clouds in front of the horizon, nearest first for early depth rejection */
+void EarthScreen::drawPatches (int sphere)
+{
+    GLfloat radius = (sphere == CLOUDS) ? CLOUDS_RADIUS : EARTH_RADIUS;
+    GLuint base = list[0] + 5 + (sphere == CLOUDS) * SPHERE_PATCHES;
+    GLfloat distance = eyevalid ? sqrtf (eye[0] * eye[0] + eye[1] * eye[1] + eye[2] * eye[2]) : 0;
+    
+    /* The quads are chords, their planes are at least radius cos (pi/32) from the center */
+    GLfloat inner = radius * cosf (M_PI / 32);
+    
+    if (distance <= radius)
+    {
+	glCallList (list[sphere]);
+	return;
+    }
+    
+    /* A direction is in front of the horizon when it is closer than that to the eye one */
+    GLfloat horizon = acosf (inner / distance);
+    std::pair<GLfloat, int> visible[SPHERE_PATCHES];
+    int count = 0;
+    
+    for (int p=0; p<SPHERE_PATCHES; p++)
+    {
+	const GLfloat* axis = patches[p].axis;
+	GLfloat cosine = (axis[0] * eye[0] + axis[1] * eye[1] + axis[2] * eye[2]) / distance;
+	GLfloat angle = acosf (MAX (-1.0f, MIN (1.0f, cosine)));
+	
+	if (angle - patches[p].angle < horizon)
+	    visible[count++] = std::make_pair (angle, p);
+    }
+    
+    std::sort (visible, visible + count, patchNearer);
+    
+    for (int i=0; i<count; i++)
+	glCallList (base + visible[i].second);
+    
+    /* Share of the patches skipped, for the debug option */
+    if (optionGetDebug () && sphere == EARTH)
+    {
+	culltotal += 100.0 * (SPHERE_PATCHES - count) / SPHERE_PATCHES;
+	if (++cullframes == 100)
+	{
+	    compLogMessage ("earth", CompLogLevelInfo, "horizon culling: %.1f%% of the earth patches skipped",
+			    culltotal / cullframes);
+	    cullframes = 0;
+	    culltotal = 0;
+	}
+    }
+}
+
 static size_t writecloudsfile(void *buffer, size_t size, size_t nmemb, void *stream)
 {
     EarthScreen::CloudsFile* out = (EarthScreen::CloudsFile*) stream;
@@ -631,48 +1478,20 @@ static size_t writecloudsfile(void *buffer, size_t size, size_t nmemb, void *str
   return fwrite(buffer, size, nmemb, out->stream);
 }
 
-void TransformClouds (CompScreen* s)
+/* Decode the cloudmap straight to the single-channel image that gets uploaded,
+ * error gets the reason of a failure and is logged by the caller on the main thread */
+bool TransformClouds (const char* filename, int resolution, void*& image, CompSize& psize, char* error)
 {
-    void* jpgdata;
-    int h, w;
-    CompString imagefile = "clouds.jpg";
-	CompString pname="earth";
-	CompSize psize;
-    if(!s->readImageFromFile (imagefile, pname, psize, jpgdata))
-		return;
-    int width=psize.width();
-	int height=psize.height();
-    char* p_jpgdata = (char*) jpgdata;
-    /* Adjust alpha channel */
-    for (h=0; h<height; h++)
-    {
-        for (w=0; w<width; w++)
-        {
-	    int pos = h * width + w;
-	    #if __BYTE_ORDER == __BIG_ENDIAN
-	    p_jpgdata[(pos * 4) + 0] = p_jpgdata[(pos * 4) + 1];
-	    #else
-	    p_jpgdata[(pos * 4) + 3] = p_jpgdata[(pos * 4) + 1];
-	    #endif
-        }
-    }
-    
-    /* Flip image vertically */
-    char* p_pngdata = new char[ width * height * 4 ];
-    
-    for (int h = 0; h < height; h++)
-		for(int i = 0; i < width * 4; i++)
-			p_pngdata[h * width * 4 + i] = p_jpgdata[(height - h - 1) * width * 4 + i];
-
-    free (jpgdata);
+    int width, height;
+    unsigned char* p_alpha = decodeClouds (filename, resolution, &width, &height, error);
     
-    // Write in the pngfile
-	CompString imagefile2 = getenv ("HOME");
-	imagefile2 += "/.compiz-1/earth/images/clouds.png";
-    s->writeImageToFile (imagefile2, "png", psize, p_pngdata);
+    if (!p_alpha)
+	return false;
     
-    /* Clean */
-    delete[] p_pngdata;
+    /* Hand the transformed map over to the caller, who frees it */
+    psize = CompSize (width, height);
+    image = p_alpha;
+    return true;
 }
 
 bool EarthPluginVTable::init()
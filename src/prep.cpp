@@ -0,0 +1,116 @@
+/*
+ * Compiz Earth plugin
+ *
+ * prep.cpp
+ *
+ * Files of processed images shared by the plugin cache and earth-prep, independent from compiz
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <earth/prep.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string prepKey (const std::string& source, const std::string& variant)
+{
+    struct stat attrib;
+    char resolved[PATH_MAX];
+    char times[64];
+
+    if (source.empty () || stat (source.c_str (), &attrib) != 0)
+	return source + "#" + variant;
+
+    /* The plugin and earth-prep may not spell the path the same way */
+    std::string path = realpath (source.c_str (), resolved) ? resolved : source;
+
+    snprintf (times, sizeof (times), "#%ld#%ld", (long) attrib.st_mtime, (long) attrib.st_size);
+    return path + "#" + variant + times;
+}
+
+std::string prepFile (const std::string& source, const std::string& variant, const std::string& images)
+{
+    std::string dir, name;
+    size_t slash = source.rfind ('/');
+
+    if (source.empty ())
+    {
+	const char* home = getenv ("HOME");
+
+	dir = images.empty () ? std::string (home ? home : "") + "/.compiz-1/earth/images/" : images;
+	name = variant;
+    }
+    else
+    {
+	dir = (slash == std::string::npos) ? "" : source.substr (0, slash + 1);
+	name = source.substr (slash == std::string::npos ? 0 : slash + 1);
+	if (!variant.empty ())
+	    name += "." + variant;
+    }
+
+    return dir + "prep/" + name + ".prep";
+}
+
+void* prepMap (int fd, const std::string& key, size_t* length)
+{
+    struct stat attrib;
+
+    if (fd < 0 || fstat (fd, &attrib) != 0 || attrib.st_size < CACHE_HEADER_SIZE)
+	return NULL;
+
+    /* Anyone can create a segment with a predictable name, only trust our own */
+    if (attrib.st_uid != getuid () || (attrib.st_mode & (S_IWGRP | S_IWOTH)))
+	return NULL;
+
+    void* map = mmap (NULL, attrib.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+	return NULL;
+
+    CacheHeader* header = (CacheHeader*) map;
+    size_t bytes = (size_t) header->width * header->height * header->channels * header->faces;
+
+    if (memcmp (header->magic, CACHE_MAGIC, 8) != 0 ||
+	key.compare (0, sizeof (header->key), header->key) != 0 ||
+	CACHE_HEADER_SIZE + bytes > (size_t) attrib.st_size)
+    {
+	munmap (map, attrib.st_size);
+	return NULL;
+    }
+
+    *length = attrib.st_size;
+    return map;
+}
+
+void prepFillHeader (CacheHeader* header, const std::string& key, int width, int height, int channels, int faces)
+{
+    header->width = width;
+    header->height = height;
+    header->channels = channels;
+    header->faces = faces;
+    memset (header->key, 0, sizeof (header->key));
+    strncpy (header->key, key.c_str (), sizeof (header->key) - 1);
+
+    __sync_synchronize ();
+    memcpy (header->magic, CACHE_MAGIC, 8);
+}
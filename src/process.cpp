@@ -0,0 +1,517 @@
+/*
+ * Compiz Earth plugin
+ *
+ * process.cpp
+ *
+ * Image processing of the earth textures, independent from compiz
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <earth/process.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <jpeglib.h>
+#include <png.h>
+#include <pthread.h>
+#include <unistd.h>
+
+struct ParallelData
+{
+    ParallelRange range;
+    void* closure;
+    int begin, end;
+    pthread_t tid;
+};
+
+static void* parallelThread (void* p)
+{
+    ParallelData* data = (ParallelData*) p;
+
+    data->range (data->begin, data->end, data->closure);
+    return NULL;
+}
+
+void parallelFor (int count, ParallelRange range, void* closure)
+{
+    int threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+	threads = 1;
+    if (threads > count)
+	threads = count;
+    if (threads <= 1)
+    {
+	range (0, count, closure);
+	return;
+    }
+
+    ParallelData* data = new ParallelData[threads];
+
+    for (int i = 0; i < threads; i++)
+    {
+	data[i].range = range;
+	data[i].closure = closure;
+	data[i].begin = (long) count * i / threads;
+	data[i].end = (long) count * (i + 1) / threads;
+    }
+
+    /* The calling thread takes the first range itself */
+    for (int i = 1; i < threads; i++)
+	if (pthread_create (&data[i].tid, NULL, parallelThread, &data[i]) != 0)
+	    data[i].tid = 0;
+
+    range (data[0].begin, data[0].end, closure);
+
+    for (int i = 1; i < threads; i++)
+    {
+	if (data[i].tid)
+	    pthread_join (data[i].tid, NULL);
+	else
+	    range (data[i].begin, data[i].end, closure);
+    }
+
+    delete[] data;
+}
+
+struct CloudsJpegError
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char* message;
+};
+
+static void cloudsJpegErrorExit (j_common_ptr cinfo)
+{
+    CloudsJpegError* err = (CloudsJpegError*) cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message) (cinfo, message);
+    snprintf (err->message, CLOUDS_ERROR_LENGTH, "%s", message);
+    longjmp (err->jump, 1);
+}
+
+/* The DCT scaling decodeClouds and cloudsSize agree on */
+static void cloudsScale (struct jpeg_decompress_struct* cinfo, int resolution)
+{
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 1;
+    while (cinfo->scale_denom < 4 && cinfo->image_width / (cinfo->scale_denom * 2) >= (unsigned int) resolution)
+	cinfo->scale_denom *= 2;
+}
+
+unsigned char* decodeClouds (const char* filename, int resolution, int* width, int* height, char* error)
+{
+    struct jpeg_decompress_struct cinfo;
+    CloudsJpegError jerr;
+    unsigned char* volatile alpha = NULL;
+    FILE* file;
+
+    error[0] = 0;
+    file = fopen (filename, "rb");
+    if (!file)
+	return NULL;
+
+    cinfo.err = jpeg_std_error (&jerr.pub);
+    jerr.pub.error_exit = cloudsJpegErrorExit;
+    jerr.message = error;
+    if (setjmp (jerr.jump))
+    {
+	jpeg_destroy_decompress (&cinfo);
+	fclose (file);
+	free (alpha);
+	return NULL;
+    }
+
+    jpeg_create_decompress (&cinfo);
+    jpeg_stdio_src (&cinfo, file);
+    jpeg_read_header (&cinfo, TRUE);
+
+    /* Only the luminance is kept, as the alpha of white clouds */
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cloudsScale (&cinfo, resolution);
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress (&cinfo);
+
+    int w = cinfo.output_width;
+    int h = cinfo.output_height;
+    alpha = (unsigned char*) malloc ((size_t) w * h);
+
+    /* Flip image vertically while decoding */
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+	JSAMPROW row = alpha + (size_t) (h - cinfo.output_scanline - 1) * w;
+	jpeg_read_scanlines (&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress (&cinfo);
+    jpeg_destroy_decompress (&cinfo);
+    fclose (file);
+
+    *width = w;
+    *height = h;
+    return alpha;
+}
+
+bool cloudsSize (const char* filename, int resolution, int* width, int* height)
+{
+    size_t length = strlen (filename);
+
+    /* Anything but a JPEG is taken as it is */
+    if (length < 4 || strcmp (filename + length - 4, ".jpg") != 0)
+    {
+	png_image png;
+
+	memset (&png, 0, sizeof (png));
+	png.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file (&png, filename))
+	    return false;
+	*width = png.width;
+	*height = png.height;
+	png_image_free (&png);
+	return true;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    CloudsJpegError jerr;
+    char message[CLOUDS_ERROR_LENGTH];
+    FILE* file = fopen (filename, "rb");
+
+    if (!file)
+	return false;
+
+    cinfo.err = jpeg_std_error (&jerr.pub);
+    jerr.pub.error_exit = cloudsJpegErrorExit;
+    jerr.message = message;
+    if (setjmp (jerr.jump))
+    {
+	jpeg_destroy_decompress (&cinfo);
+	fclose (file);
+	return false;
+    }
+
+    jpeg_create_decompress (&cinfo);
+    jpeg_stdio_src (&cinfo, file);
+    jpeg_read_header (&cinfo, TRUE);
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cloudsScale (&cinfo, resolution);
+    jpeg_calc_output_dimensions (&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    jpeg_destroy_decompress (&cinfo);
+    fclose (file);
+    return true;
+}
+
+unsigned char* decodePng (const char* filename, int* width, int* height, bool premultiply, char* error)
+{
+    png_image png;
+
+    memset (&png, 0, sizeof (png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file (&png, filename))
+    {
+	snprintf (error, PNG_ERROR_LENGTH, "%s", png.message);
+	return NULL;
+    }
+
+    #if __BYTE_ORDER == __BIG_ENDIAN
+    png.format = PNG_FORMAT_ARGB;
+    const int a = 0, c = 1;
+    #else
+    png.format = PNG_FORMAT_BGRA;
+    const int a = 3, c = 0;
+    #endif
+
+    unsigned char* data = (unsigned char*) malloc (PNG_IMAGE_SIZE (png));
+    if (!png_image_finish_read (&png, NULL, data, 0, NULL))
+    {
+	snprintf (error, PNG_ERROR_LENGTH, "%s", png.message);
+	png_image_free (&png);
+	free (data);
+	return NULL;
+    }
+
+    if (premultiply)
+    {
+	for (size_t i = 0; i < (size_t) png.width * png.height; i++)
+	{
+	    unsigned char* p = data + i * 4;
+
+	    for (int k = c; k < c + 3; k++)
+		p[k] = (p[k] * p[a] + 127) / 255;
+	}
+    }
+
+    error[0] = 0;
+    *width = png.width;
+    *height = png.height;
+    return data;
+}
+
+int cubeFaceSize (int width)
+{
+    return (width + 3) / 4;
+}
+
+void reprojectCubeRows (const unsigned char* src, int width, int height, int channels,
+			unsigned char* dst, int size, int begin, int end)
+{
+    for (int row = begin; row < end; row++)
+    {
+	int face = row / size;
+	int j = row % size;
+	float t = 2.0f * (j + 0.5f) / size - 1.0f;
+	unsigned char* out = dst + (size_t) row * size * channels;
+
+	for (int i = 0; i < size; i++)
+	{
+	    float s = 2.0f * (i + 0.5f) / size - 1.0f;
+	    float x, y, z;
+
+	    switch (face)
+	    {
+		case 0:	x = 1;	y = -t;	z = -s;	break;
+		case 1:	x = -1;	y = -t;	z = s;	break;
+		case 2:	x = s;	y = 1;	z = t;	break;
+		case 3:	x = s;	y = -1;	z = -t;	break;
+		case 4:	x = s;	y = -t;	z = 1;	break;
+		default:x = -s;	y = -t;	z = -1;	break;
+	    }
+
+	    float len = sqrtf (x * x + y * y + z * z);
+	    float a = atan2f (x, y);
+	    if (a < 0)
+		a += 2 * M_PI;
+
+	    /* Texel centers of the source, bilinear, wrapping around in longitude */
+	    float u = (1.0f - a / (2 * M_PI)) * width - 0.5f;
+	    float v = acosf (z / len) / M_PI * height - 0.5f;
+	    int u0 = (int) floorf (u);
+	    int v0 = (int) floorf (v);
+	    float fu = u - u0;
+	    float fv = v - v0;
+	    int v1 = v0 + 1;
+
+	    u0 = ((u0 % width) + width) % width;
+	    int u1 = (u0 + 1) % width;
+	    if (v0 < 0)
+		v0 = 0;
+	    if (v1 > height - 1)
+		v1 = height - 1;
+	    if (v0 > height - 1)
+		v0 = height - 1;
+
+	    const unsigned char* p00 = src + ((size_t) v0 * width + u0) * channels;
+	    const unsigned char* p01 = src + ((size_t) v0 * width + u1) * channels;
+	    const unsigned char* p10 = src + ((size_t) v1 * width + u0) * channels;
+	    const unsigned char* p11 = src + ((size_t) v1 * width + u1) * channels;
+
+	    for (int c = 0; c < channels; c++)
+	    {
+		float top = p00[c] + (p01[c] - p00[c]) * fu;
+		float bottom = p10[c] + (p11[c] - p10[c]) * fu;
+		out[i * channels + c] = (unsigned char) (top + (bottom - top) * fv + 0.5f);
+	    }
+	}
+    }
+}
+
+struct ReprojectData
+{
+    const unsigned char* src;
+    int width, height, channels;
+    unsigned char* dst;
+    int size;
+};
+
+static void reprojectRange (int begin, int end, void* closure)
+{
+    ReprojectData* data = (ReprojectData*) closure;
+
+    reprojectCubeRows (data->src, data->width, data->height, data->channels,
+		       data->dst, data->size, begin, end);
+}
+
+void reprojectCube (const unsigned char* src, int width, int height, int channels,
+		    unsigned char* dst, int size)
+{
+    ReprojectData data = { src, width, height, channels, dst, size };
+
+    parallelFor (6 * size, reprojectRange, &data);
+}
+
+/* Real atmosphere coefficients per km, spread over the thicker one */
+#define ATMOSPHERE_THICKENING ((ATMOSPHERE_RT - ATMOSPHERE_RG) / 60.0f)
+
+static const float betaR[3] = { 5.8e-3f / ATMOSPHERE_THICKENING,
+				13.5e-3f / ATMOSPHERE_THICKENING,
+				33.1e-3f / ATMOSPHERE_THICKENING };
+static const float betaM = 21e-3f / ATMOSPHERE_THICKENING;
+static const float betaMExt = betaM / 0.9f;
+static const float heightR = 8.0f * ATMOSPHERE_THICKENING;
+static const float heightM = 1.2f * ATMOSPHERE_THICKENING;
+
+/* Rayleigh and Mie optical lengths from radius r to the top of the atmosphere, false if the ground is in the way */
+static bool opticalLength (float r, float mu, float& lengthR, float& lengthM)
+{
+    const int steps = 32;
+    float ground = r * r * (mu * mu - 1) + ATMOSPHERE_RG * ATMOSPHERE_RG;
+
+    lengthR = lengthM = 0;
+    if (mu < 0 && ground >= 0)
+	return false;
+
+    float tmax = -r * mu + sqrtf (r * r * (mu * mu - 1) + ATMOSPHERE_RT * ATMOSPHERE_RT);
+    float dt = tmax / steps;
+
+    for (int i = 0; i < steps; i++)
+    {
+	float t = (i + 0.5f) * dt;
+	float h = sqrtf (r * r + 2 * r * mu * t + t * t) - ATMOSPHERE_RG;
+
+	lengthR += expf (-h / heightR) * dt;
+	lengthM += expf (-h / heightM) * dt;
+    }
+    return true;
+}
+
+static unsigned short encode (float value, float scale)
+{
+    value /= scale;
+    if (value < 0)
+	value = 0;
+    if (value > 1)
+	value = 1;
+    return (unsigned short) (value * 65535.0f + 0.5f);
+}
+
+void transmittanceRows (unsigned short* dst, int begin, int end)
+{
+    for (int j = begin; j < end; j++)
+    {
+	float r = ATMOSPHERE_RG + (ATMOSPHERE_RT - ATMOSPHERE_RG) * (j + 0.5f) / ATMOSPHERE_TRANSMITTANCE_HEIGHT;
+	unsigned short* out = dst + (size_t) j * ATMOSPHERE_TRANSMITTANCE_WIDTH * 4;
+
+	for (int i = 0; i < ATMOSPHERE_TRANSMITTANCE_WIDTH; i++)
+	{
+	    float mu = 2.0f * (i + 0.5f) / ATMOSPHERE_TRANSMITTANCE_WIDTH - 1.0f;
+	    float lengthR, lengthM;
+	    bool lit = opticalLength (r, mu, lengthR, lengthM);
+
+	    for (int c = 0; c < 3; c++)
+		out[i * 4 + c] = lit ? encode (expf (-(betaR[c] * lengthR + betaMExt * lengthM)), 1.0f) : 0;
+	    out[i * 4 + 3] = 65535;
+	}
+    }
+}
+
+void scatteringRows (unsigned short* dst, int begin, int end)
+{
+    const int steps = 48;
+
+    for (int j = begin; j < end; j++)
+    {
+	float v = (j + 0.5f) / ATMOSPHERE_SCATTERING_HEIGHT;
+	float p = (v < 0.5f) ? 2 * v * ATMOSPHERE_RG :
+			       ATMOSPHERE_RG + (2 * v - 1) * (ATMOSPHERE_RT - ATMOSPHERE_RG);
+	unsigned short* out = dst + (size_t) j * ATMOSPHERE_SCATTERING_WIDTH * 4;
+
+	/* The ray enters the top of the atmosphere and leaves it, or stops on the ground */
+	float t0 = -sqrtf (ATMOSPHERE_RT * ATMOSPHERE_RT - p * p);
+	float t1 = (p < ATMOSPHERE_RG) ? -sqrtf (ATMOSPHERE_RG * ATMOSPHERE_RG - p * p) : -t0;
+	float dt = (t1 - t0) / steps;
+
+	for (int i = 0; i < ATMOSPHERE_SCATTERING_WIDTH; i++)
+	{
+	    float mus = 2.0f * (i % ATMOSPHERE_SCATTERING_MUS) / (ATMOSPHERE_SCATTERING_MUS - 1) - 1.0f;
+	    float nu = 2.0f * (i / ATMOSPHERE_SCATTERING_MUS) / (ATMOSPHERE_SCATTERING_NU - 1) - 1.0f;
+	    float viewR = 0, viewM = 0;
+	    float rayleigh[3] = { 0, 0, 0 };
+	    float mie = 0;
+
+	    /* The sun direction is at most a unit vector away from both the ray and the closest point */
+	    if (mus * mus + nu * nu > 1)
+	    {
+		float scale = 1 / sqrtf (mus * mus + nu * nu);
+
+		mus *= scale;
+		nu *= scale;
+	    }
+
+	    for (int k = 0; k < steps; k++)
+	    {
+		float t = t0 + (k + 0.5f) * dt;
+		float r = sqrtf (p * p + t * t);
+		float densityR = expf (-(r - ATMOSPHERE_RG) / heightR) * dt;
+		float densityM = expf (-(r - ATMOSPHERE_RG) / heightM) * dt;
+		float sunR, sunM;
+
+		/* Optical length from the viewer up to the middle of this step */
+		viewR += densityR / 2;
+		viewM += densityM / 2;
+
+		if (opticalLength (r, (p * mus + t * nu) / r, sunR, sunM))
+		{
+		    float mean = 0;
+
+		    for (int c = 0; c < 3; c++)
+		    {
+			float attenuation = expf (-(betaR[c] * (sunR + viewR) + betaMExt * (sunM + viewM)));
+
+			rayleigh[c] += betaR[c] * densityR * attenuation;
+			mean += attenuation / 3;
+		    }
+		    mie += betaM * densityM * mean;
+		}
+
+		viewR += densityR / 2;
+		viewM += densityM / 2;
+	    }
+
+	    for (int c = 0; c < 3; c++)
+		out[i * 4 + c] = encode (rayleigh[c], ATMOSPHERE_SCATTERING_SCALE);
+	    out[i * 4 + 3] = encode (mie, ATMOSPHERE_SCATTERING_SCALE);
+	}
+    }
+}
+
+static void transmittanceRange (int begin, int end, void* closure)
+{
+    transmittanceRows ((unsigned short*) closure, begin, end);
+}
+
+static void scatteringRange (int begin, int end, void* closure)
+{
+    scatteringRows ((unsigned short*) closure, begin, end);
+}
+
+void computeTransmittance (unsigned short* dst)
+{
+    parallelFor (ATMOSPHERE_TRANSMITTANCE_HEIGHT, transmittanceRange, dst);
+}
+
+void computeScattering (unsigned short* dst)
+{
+    parallelFor (ATMOSPHERE_SCATTERING_HEIGHT, scatteringRange, dst);
+}
@@ -0,0 +1,243 @@
+/*
+ * Compiz Earth plugin
+ *
+ * ring.cpp
+ *
+ * Memory-mapped history of the processed cloudmaps, independent from compiz
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <earth/ring.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+std::string cloudsRingFile (const std::string& base, int slots, int width, int height)
+{
+    char geometry[64];
+
+    if (slots > CLOUDS_RING_MAX)
+	slots = CLOUDS_RING_MAX;
+    snprintf (geometry, sizeof (geometry), "-%dx%d-%d.ring", width, height, slots);
+    return base + geometry;
+}
+
+static size_t cloudsRingLength (int slots, int width, int height)
+{
+    return CLOUDS_RING_HEADER_SIZE + (size_t) slots * width * height;
+}
+
+static bool cloudsRingMap (CloudsRing* ring, int fd, size_t length, int prot)
+{
+    ring->map = mmap (NULL, length, prot, MAP_SHARED, fd, 0);
+    if (ring->map == MAP_FAILED)
+    {
+	ring->map = NULL;
+	return false;
+    }
+    ring->length = length;
+    ring->header = (CloudsRingHeader*) ring->map;
+    return true;
+}
+
+bool cloudsRingOpen (CloudsRing* ring, const char* filename, int slots)
+{
+    struct stat attrib;
+    CloudsRingHeader header;
+
+    ring->map = NULL;
+    ring->header = NULL;
+    if (slots > CLOUDS_RING_MAX)
+	slots = CLOUDS_RING_MAX;
+
+    int fd = open (filename, O_RDWR);
+    if (fd < 0)
+	return false;
+
+    /* Nothing read from the file may point outside of it */
+    if (read (fd, &header, sizeof (header)) != sizeof (header) ||
+	memcmp (header.magic, CLOUDS_RING_MAGIC, 8) != 0 ||
+	header.slots != slots || header.width <= 0 || header.height <= 0 ||
+	header.count < 0 || header.count > header.slots ||
+	(header.count == 0 ? header.newest != -1 : header.newest < 0 || header.newest >= header.slots) ||
+	fstat (fd, &attrib) != 0 ||
+	(size_t) attrib.st_size != cloudsRingLength (header.slots, header.width, header.height))
+    {
+	close (fd);
+	return false;
+    }
+
+    bool mapped = cloudsRingMap (ring, fd, attrib.st_size, PROT_READ | PROT_WRITE);
+    close (fd);
+    return mapped;
+}
+
+void cloudsRingClose (CloudsRing* ring)
+{
+    if (ring->map)
+	munmap (ring->map, ring->length);
+    ring->map = NULL;
+    ring->header = NULL;
+}
+
+const unsigned char* cloudsRingEntry (CloudsRing* ring, int age, time_t* time)
+{
+    CloudsRingHeader* header = ring->header;
+
+    if (!header || age >= header->count)
+	return NULL;
+
+    int slot = (header->newest - age + header->slots) % header->slots;
+    if (time)
+	*time = header->time[slot];
+
+    return (const unsigned char*) ring->map + CLOUDS_RING_HEADER_SIZE +
+	   (size_t) slot * header->width * header->height;
+}
+
+static void cloudsRingInit (CloudsRingHeader* header, int slots, int width, int height)
+{
+    memset (header, 0, sizeof (CloudsRingHeader));
+    header->slots = slots;
+    header->width = width;
+    header->height = height;
+    header->newest = -1;
+    memcpy (header->magic, CLOUDS_RING_MAGIC, 8);
+}
+
+/*
+ * Maps the ring behind fd, which the caller holds locked. An empty file was
+ * just created and is sized here. Anything else that is not the expected ring
+ * is replaced by a new file renamed over it, never truncated, as it may be
+ * mapped by someone else.
+ */
+static bool cloudsRingAttach (CloudsRing* ring, int fd, const char* filename, int slots, int width, int height)
+{
+    size_t length = cloudsRingLength (slots, width, height);
+    struct stat attrib;
+    CloudsRingHeader header;
+
+    if (fstat (fd, &attrib) != 0)
+	return false;
+
+    if (attrib.st_size == 0)
+    {
+	if (ftruncate (fd, length) != 0 || !cloudsRingMap (ring, fd, length, PROT_READ | PROT_WRITE))
+	    return false;
+	cloudsRingInit (ring->header, slots, width, height);
+	return true;
+    }
+
+    if ((size_t) attrib.st_size == length &&
+	pread (fd, &header, sizeof (header), 0) == sizeof (header) &&
+	memcmp (header.magic, CLOUDS_RING_MAGIC, 8) == 0 &&
+	header.slots == slots && header.width == width && header.height == height &&
+	header.count >= 0 && header.count <= slots &&
+	(header.count == 0 ? header.newest == -1 : header.newest >= 0 && header.newest < slots))
+	return cloudsRingMap (ring, fd, length, PROT_READ | PROT_WRITE);
+
+    std::string temp = std::string (filename) + ".XXXXXX";
+    int tfd = mkstemp (&temp[0]);
+    if (tfd < 0)
+	return false;
+
+    if (fchmod (tfd, 0644) != 0 || ftruncate (tfd, length) != 0 || !cloudsRingMap (ring, tfd, length, PROT_READ | PROT_WRITE))
+    {
+	close (tfd);
+	unlink (temp.c_str ());
+	return false;
+    }
+    close (tfd);
+    cloudsRingInit (ring->header, slots, width, height);
+
+    if (rename (temp.c_str (), filename) != 0)
+    {
+	cloudsRingClose (ring);
+	unlink (temp.c_str ());
+	return false;
+    }
+    return true;
+}
+
+bool cloudsRingPush (CloudsRing* ring, const char* filename, int slots,
+		     const unsigned char* data, int width, int height, time_t time)
+{
+    CloudsRingHeader* header = ring->header;
+
+    if (slots > CLOUDS_RING_MAX)
+	slots = CLOUDS_RING_MAX;
+
+    /* Every screen and earth-prep push to the same files, one at a time,
+     * on the file that is still behind the name once the lock is held */
+    int fd;
+    for (;;)
+    {
+	struct stat opened, named;
+
+	fd = open (filename, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	    return false;
+	flock (fd, LOCK_EX);
+	if (fstat (fd, &opened) == 0 && stat (filename, &named) == 0 &&
+	    opened.st_dev == named.st_dev && opened.st_ino == named.st_ino)
+	    break;
+	close (fd);
+    }
+
+    if (!header || header->slots != slots || header->width != width || header->height != height)
+    {
+	cloudsRingClose (ring);
+	if (!cloudsRingAttach (ring, fd, filename, slots, width, height))
+	{
+	    close (fd);
+	    return false;
+	}
+	header = ring->header;
+    }
+
+    int slot = (header->newest + 1) % header->slots;
+
+    /* The oldest entry is being overwritten, it stops being valid first */
+    if (header->count == header->slots)
+    {
+	header->count--;
+	__sync_synchronize ();
+    }
+
+    unsigned char* dst = (unsigned char*) ring->map + CLOUDS_RING_HEADER_SIZE + (size_t) slot * width * height;
+
+    memcpy (dst, data, (size_t) width * height);
+    header->time[slot] = time;
+
+    /* Publish the slot only once it is complete */
+    __sync_synchronize ();
+    header->newest = slot;
+    if (header->count < header->slots)
+	header->count++;
+
+    msync (ring->map, ring->length, MS_ASYNC);
+    close (fd);
+    return true;
+}
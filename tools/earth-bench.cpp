@@ -0,0 +1,425 @@
+/*
+ * Compiz Earth plugin
+ *
+ * earth-bench.cpp
+ *
+ * Offscreen benchmark of the earth shaders, run outside of the compositor
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Usage: earth-bench [-s size] [-f frames] [data directory]
+ *
+ * Draws a full viewport earth into an offscreen EGL pbuffer with the shaders of
+ * the data directory (~/.compiz-1/earth/data by default) and the atmosphere
+ * tables of the plugin, and prints the milliseconds per frame of each pass:
+ * the shaders from before the atmosphere as a baseline, then equirectangular or
+ * cubemap maps, with and without the atmosphere shell.
+ * The maps are 2048x1024 like the default ones, or 6 faces of 512x512.
+ *
+ * Run with EGL_PLATFORM=surfaceless where there is no display, and with
+ * LIBGL_ALWAYS_SOFTWARE=1 to measure llvmpipe on a machine with a GPU. In the
+ * compositor, the debug option logs the GPU time of the same passes.
+ */
+
+#define GL_GLEXT_PROTOTYPES 1
+#include <EGL/egl.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <earth/process.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#define MAP_WIDTH 2048
+#define MAP_HEIGHT 1024
+#define EARTH_RADIUS 0.89f
+
+enum
+{
+    PASS_BASELINE,
+    PASS_EQUIRECT,
+    PASS_CUBEMAP,
+    PASS_EQUIRECT_ATMOSPHERE,
+    PASS_CUBEMAP_ATMOSPHERE,
+    PASSES
+};
+
+static const char* passNames[PASSES] = {
+    "baseline earth",
+    "equirectangular earth",
+    "cubemap earth",
+    "equirectangular earth + atmosphere",
+    "cubemap earth + atmosphere"
+};
+
+static std::string dataDir;
+
+/* The earth shaders before the atmosphere, the maps read from the equirectangular coordinates */
+static const char* baselineVert =
+    "varying vec3 normal, halfVect, lightDir;\n"
+    "varying vec4 ambient, diffuse;\n"
+    "void main()\n"
+    "{\n"
+    "    normal = normalize (gl_NormalMatrix * gl_Normal);\n"
+    "    halfVect = normalize (gl_LightSource[1].halfVector.xyz);\n"
+    "    lightDir = normalize (vec3(gl_LightSource[1].position));\n"
+    "    ambient = (gl_LightSource[1].ambient + gl_LightModel.ambient) * gl_FrontMaterial.ambient;\n"
+    "    diffuse = gl_LightSource[1].diffuse * gl_FrontMaterial.diffuse;\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord1;\n"
+    "    gl_Position = ftransform ();\n"
+    "}\n";
+
+static const char* baselineFrag =
+    "#version 130\n"
+    "uniform sampler2D daytex, nighttex;\n"
+    "varying vec3 normal, halfVect, lightDir;\n"
+    "varying vec4 ambient, diffuse;\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 normal_, halfVect_;\n"
+    "    float NdotL, NdotHV;\n"
+    "    vec4 daytexel = texture2D (daytex, gl_TexCoord[0].st);\n"
+    "    vec4 nighttexel = texture2D (nighttex, gl_TexCoord[0].st);\n"
+    "    normal_ = normalize (normal);\n"
+    "    NdotL = clamp (dot (normal_, lightDir)*2 + 0.2, 0.0, 1.0);\n"
+    "    vec4 color;\n"
+    "    color = (ambient + NdotL*diffuse) * daytexel;\n"
+    "    float coeff = clamp((1-NdotL-0.9)*10 ,0,1);\n"
+    "    color += nighttexel * coeff;\n"
+    "    halfVect_ = normalize (halfVect);\n"
+    "    NdotHV = max (dot (normal_, halfVect_), 0.0);\n"
+    "    if ((daytexel.b>0.1 && daytexel.r<0.2) || (daytexel.r>0.8 && daytexel.g>0.9 && daytexel.b>0.9))\n"
+    "        color += gl_LightSource[1].specular * gl_FrontMaterial.specular * pow(NdotHV, gl_FrontMaterial.shininess);\n"
+    "    else\n"
+    "        color += 0.3 * gl_LightSource[1].specular * gl_FrontMaterial.specular * pow(NdotHV, gl_FrontMaterial.shininess/4);\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+static double now ()
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static GLuint compileShader (GLenum type, const std::string& file, const std::string& source)
+{
+    GLint compiled;
+    GLuint shader = glCreateShader (type);
+    const char* c = source.c_str ();
+    glShaderSource (shader, 1, &c, NULL);
+    glCompileShader (shader);
+
+    glGetShaderiv (shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled)
+    {
+	char log[4096];
+
+	glGetShaderInfoLog (shader, sizeof (log), NULL, log);
+	fprintf (stderr, "earth-bench: %s: %s\n", file.c_str (), log);
+	exit (1);
+    }
+    return shader;
+}
+
+/* Same as the plugin cache: the defines go after the #version line */
+static GLuint loadShader (GLenum type, const std::string& file, const std::string& defines)
+{
+    std::ifstream in (file.c_str ());
+    std::string source ((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char> ());
+    size_t line = 0;
+
+    if (source.compare (0, 8, "#version") == 0)
+    {
+	line = source.find ('\n');
+	line = (line == std::string::npos) ? source.size () : line + 1;
+    }
+    source.insert (line, defines);
+    return compileShader (type, file, source);
+}
+
+static GLuint linkProgram (const char* name, GLuint vert, GLuint frag)
+{
+    GLuint prog = glCreateProgram ();
+    GLint linked;
+
+    glAttachShader (prog, vert);
+    glAttachShader (prog, frag);
+    glLinkProgram (prog);
+
+    glGetProgramiv (prog, GL_LINK_STATUS, &linked);
+    if (!linked)
+    {
+	fprintf (stderr, "earth-bench: unable to link the %s shaders\n", name);
+	exit (1);
+    }
+    return prog;
+}
+
+static GLuint loadProgram (const char* name, const std::string& defines)
+{
+    return linkProgram (name, loadShader (GL_VERTEX_SHADER, dataDir + name + ".vert", defines),
+			loadShader (GL_FRAGMENT_SHADER, dataDir + name + ".frag", defines));
+}
+
+/* Outer sphere with the texture coordinates of the plugin: directions in the first set, equirectangular in the second */
+static void makeSphere (GLfloat radius)
+{
+    for (int j = 0; j < 64; j++)
+    {
+	glBegin (GL_QUAD_STRIP);
+	for (int i = 0; i <= 64; i++)
+	{
+	    for (int k = 1; k >= 0; k--)
+	    {
+		float theta = M_PI * (j + k) / 64, phi = 2 * M_PI * i / 64;
+		float x = sinf (theta) * sinf (phi), y = sinf (theta) * cosf (phi), z = cosf (theta);
+
+		glNormal3f (x, y, z);
+		glTexCoord3f (x, y, z);
+		glMultiTexCoord2f (GL_TEXTURE1, 1 - (float) i / 64, (float) (j + k) / 64);
+		glVertex3f (radius * x, radius * y, radius * z);
+	    }
+	}
+	glEnd ();
+    }
+}
+
+/* Land and sea stripes, so that the specular test takes both branches */
+static std::vector<unsigned char> makeMap ()
+{
+    std::vector<unsigned char> map ((size_t) MAP_WIDTH * MAP_HEIGHT * 4);
+
+    for (int j = 0; j < MAP_HEIGHT; j++)
+    {
+	for (int i = 0; i < MAP_WIDTH; i++)
+	{
+	    unsigned char* p = &map[((size_t) j * MAP_WIDTH + i) * 4];
+	    bool sea = ((i / 64 + j / 64) % 3) != 0;
+
+	    p[0] = sea ? 160 : 40;
+	    p[1] = sea ? 60 : 120;
+	    p[2] = sea ? 20 : 90;
+	    p[3] = 255;
+	}
+    }
+    return map;
+}
+
+static GLuint makeTexture (GLenum target, int faces, int width, int height, GLenum format, GLenum type,
+			   GLint internal, const void* data, bool mipmaps)
+{
+    GLuint texture;
+    size_t facebytes = (size_t) width * height * (type == GL_UNSIGNED_SHORT ? 8 : 4);
+
+    glGenTextures (1, &texture);
+    glBindTexture (target, texture);
+    glTexParameteri (target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri (target, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri (target, GL_TEXTURE_WRAP_S, (target == GL_TEXTURE_2D && mipmaps) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    glTexParameteri (target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri (target, GL_GENERATE_MIPMAP, mipmaps);
+
+    for (int f = 0; f < faces; f++)
+	glTexImage2D (faces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + f : GL_TEXTURE_2D, 0, internal,
+		      width, height, 0, format, type, (const char*) data + f * facebytes);
+
+    glBindTexture (target, 0);
+    return texture;
+}
+
+static void usage ()
+{
+    fprintf (stderr, "usage: earth-bench [-s size] [-f frames] [data directory]\n"
+		     "  -s  width and height of the viewport (1024)\n"
+		     "  -f  frames drawn for each pass (60)\n");
+}
+
+int main (int argc, char** argv)
+{
+    int size = 1024, frames = 60;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "s:f:h")) != -1)
+    {
+	switch (opt)
+	{
+	    case 's':	size = atoi (optarg);	break;
+	    case 'f':	frames = atoi (optarg);	break;
+	    default:	usage ();		return 1;
+	}
+    }
+    if (optind < argc - 1 || size < 1 || frames < 1)
+    {
+	usage ();
+	return 1;
+    }
+
+    const char* home = getenv ("HOME");
+    dataDir = (optind < argc) ? argv[optind] : std::string (home ? home : "") + "/.compiz-1/earth/data";
+    if (dataDir.empty () || dataDir[dataDir.size () - 1] != '/')
+	dataDir += "/";
+
+    /* Offscreen desktop GL context */
+    EGLDisplay display = eglGetDisplay (EGL_DEFAULT_DISPLAY);
+    EGLint attribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			 EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+    EGLint pbuffer[] = { EGL_WIDTH, size, EGL_HEIGHT, size, EGL_NONE };
+    EGLConfig config;
+    EGLint configs;
+
+    if (!eglInitialize (display, NULL, NULL) || !eglBindAPI (EGL_OPENGL_API) ||
+	!eglChooseConfig (display, attribs, &config, 1, &configs) || configs < 1)
+    {
+	fprintf (stderr, "earth-bench: no EGL display with desktop GL, try EGL_PLATFORM=surfaceless\n");
+	return 1;
+    }
+
+    EGLSurface surface = eglCreatePbufferSurface (display, config, pbuffer);
+    EGLContext context = eglCreateContext (display, config, EGL_NO_CONTEXT, NULL);
+    if (!eglMakeCurrent (display, surface, surface, context))
+    {
+	fprintf (stderr, "earth-bench: unable to create a GL context\n");
+	return 1;
+    }
+
+    printf ("%s, %s\n", glGetString (GL_RENDERER), glGetString (GL_VERSION));
+
+    /* The plugin textures: maps, cubemaps reprojected like at load time, and the atmosphere tables */
+    std::vector<unsigned char> map = makeMap ();
+    int face = cubeFaceSize (MAP_WIDTH);
+    std::vector<unsigned char> cube ((size_t) 6 * face * face * 4);
+    reprojectCube (&map[0], MAP_WIDTH, MAP_HEIGHT, 4, &cube[0], face);
+
+    std::vector<unsigned short> transmittance (ATMOSPHERE_TRANSMITTANCE_WIDTH * ATMOSPHERE_TRANSMITTANCE_HEIGHT * 4);
+    std::vector<unsigned short> scattering (ATMOSPHERE_SCATTERING_WIDTH * ATMOSPHERE_SCATTERING_HEIGHT * 4);
+    computeTransmittance (&transmittance[0]);
+    computeScattering (&scattering[0]);
+
+    GLuint maps[2], cubes[2];
+    for (int i = 0; i < 2; i++)
+    {
+	maps[i] = makeTexture (GL_TEXTURE_2D, 1, MAP_WIDTH, MAP_HEIGHT, GL_BGRA, GL_UNSIGNED_BYTE, GL_RGBA, &map[0], true);
+	cubes[i] = makeTexture (GL_TEXTURE_CUBE_MAP, 6, face, face, GL_BGRA, GL_UNSIGNED_BYTE, GL_RGBA, &cube[0], true);
+    }
+    GLuint luts[2] = {
+	makeTexture (GL_TEXTURE_2D, 1, ATMOSPHERE_TRANSMITTANCE_WIDTH, ATMOSPHERE_TRANSMITTANCE_HEIGHT,
+		     GL_RGBA, GL_UNSIGNED_SHORT, GL_RGBA16, &transmittance[0], false),
+	makeTexture (GL_TEXTURE_2D, 1, ATMOSPHERE_SCATTERING_WIDTH, ATMOSPHERE_SCATTERING_HEIGHT,
+		     GL_RGBA, GL_UNSIGNED_SHORT, GL_RGBA16, &scattering[0], false)
+    };
+
+    GLuint earth[2] = { loadProgram ("earth", "#define EQUIRECT\n"), loadProgram ("earth", "") };
+    GLuint baseline = linkProgram ("baseline", compileShader (GL_VERTEX_SHADER, "baseline vertex shader", baselineVert),
+				   compileShader (GL_FRAGMENT_SHADER, "baseline fragment shader", baselineFrag));
+    GLuint atmosphere = loadProgram ("atmosphere", "");
+
+    GLuint lists = glGenLists (2);
+    glNewList (lists, GL_COMPILE);
+	makeSphere (EARTH_RADIUS);
+    glEndList ();
+    glNewList (lists + 1, GL_COMPILE);
+	makeSphere (EARTH_RADIUS * ATMOSPHERE_RT / ATMOSPHERE_RG);
+    glEndList ();
+
+    /* The earth about fills the viewport, lit from the side so that the terminator shows */
+    GLfloat light[4] = { 0.6f, 0.3f, 0.7f, 0 };
+    GLfloat white[4] = { 1, 1, 1, 1 };
+
+    glViewport (0, 0, size, size);
+    glMatrixMode (GL_PROJECTION);
+    glFrustum (-0.075, 0.075, -0.075, 0.075, 0.1, 10);
+    glMatrixMode (GL_MODELVIEW);
+    glTranslatef (0, 0, -1.3f);
+    glRotatef (-70, 1, 0, 0);
+    glLightfv (GL_LIGHT1, GL_POSITION, light);
+    glLightfv (GL_LIGHT1, GL_DIFFUSE, white);
+    glLightfv (GL_LIGHT1, GL_SPECULAR, white);
+    glEnable (GL_DEPTH_TEST);
+    glEnable (GL_CULL_FACE);
+
+    for (int pass = 0; pass < PASSES; pass++)
+    {
+	bool cubemap = (pass == PASS_CUBEMAP || pass == PASS_CUBEMAP_ATMOSPHERE);
+	bool shell = (pass >= PASS_EQUIRECT_ATMOSPHERE);
+	GLenum target = cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	GLuint prog = (pass == PASS_BASELINE) ? baseline : earth[cubemap];
+	double start = 0;
+
+	/* The first frame warms up the shaders and the texture uploads */
+	for (int frame = 0; frame <= frames; frame++)
+	{
+	    if (frame == 1)
+	    {
+		glFinish ();
+		start = now ();
+	    }
+
+	    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	    glUseProgram (prog);
+	    glActiveTexture (GL_TEXTURE0);
+	    glBindTexture (target, cubemap ? cubes[0] : maps[0]);
+	    glActiveTexture (GL_TEXTURE1);
+	    glBindTexture (target, cubemap ? cubes[1] : maps[1]);
+	    glActiveTexture (GL_TEXTURE2);
+	    glBindTexture (GL_TEXTURE_2D, luts[0]);
+	    glActiveTexture (GL_TEXTURE3);
+	    glBindTexture (target, cubemap ? cubes[0] : maps[0]);
+	    glActiveTexture (GL_TEXTURE0);
+	    glUniform1i (glGetUniformLocation (prog, "daytex"), 0);
+	    glUniform1i (glGetUniformLocation (prog, "nighttex"), 1);
+	    glUniform1i (glGetUniformLocation (prog, "transmittance"), 2);
+	    glUniform1i (glGetUniformLocation (prog, "nexttex"), 3);
+	    glUniform1f (glGetUniformLocation (prog, "season"), 0);
+	    glCallList (lists);
+
+	    if (shell)
+	    {
+		glDepthMask (GL_FALSE);
+		glEnable (GL_BLEND);
+		glBlendFunc (GL_ONE, GL_ONE);
+		glUseProgram (atmosphere);
+		glBindTexture (GL_TEXTURE_2D, luts[1]);
+		glUniform1i (glGetUniformLocation (atmosphere, "scattering"), 0);
+		glUniform2f (glGetUniformLocation (atmosphere, "radii"), EARTH_RADIUS,
+			     EARTH_RADIUS * ATMOSPHERE_RT / ATMOSPHERE_RG);
+		glCallList (lists + 1);
+		glDisable (GL_BLEND);
+		glDepthMask (GL_TRUE);
+	    }
+	}
+	glFinish ();
+
+	printf ("%-36s %8.2f ms/frame\n", passNames[pass], (now () - start) * 1000 / frames);
+    }
+
+    eglTerminate (display);
+    return 0;
+}
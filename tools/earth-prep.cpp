@@ -0,0 +1,671 @@
+/*
+ * Compiz Earth plugin
+ *
+ * earth-prep.cpp
+ *
+ * Offline preprocessing of the plugin images, run outside of the compositor
+ *
+ * Copyright : (C) 2010 by Maxime Wack
+ * E-mail    : maximewack(at)free(dot)fr
+ *
+ * Ported to Compiz 0.9.x
+ * Copyright : (C) 2012 Matija Skala <mskala@gmx.com>
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Usage: earth-prep [-f] [-j threads] [-r resolution] [-n history] [images directory]
+ *
+ * Turns the sources in ~/.compiz-1/earth/images (day.png, day01.png to day12.png,
+ * night.png, skydome.png and clouds.jpg) into the files the plugin maps instead
+ * of decoding them: cubemaps and plain copies of the maps, images and atmosphere
+ * tables in images/prep, and the cloudmap history. Everything is written under the images
+ * directory given, the plugin only looks in the default one. Outputs made from
+ * unchanged sources are skipped unless -f is given.
+ */
+
+#include <earth/prep.h>
+#include <earth/process.h>
+#include <earth/ring.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <vector>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Rows processed by one reprojection task, and by one atmosphere task: a row of
+ * the scattering table takes about as long as a whole reprojection chunk */
+#define CHUNK_ROWS 32
+#define ATMOSPHERE_CHUNK_ROWS 1
+
+enum
+{
+    STAGE_DECODE,
+    STAGE_REPROJECT,
+    STAGE_ATMOSPHERE,
+    STAGE_WRITE,
+    STAGES
+};
+
+enum
+{
+    ASSET_CUBE,
+    ASSET_IMAGE,
+    ASSET_CLOUDS,
+    ASSET_TRANSMITTANCE,
+    ASSET_SCATTERING
+};
+
+/* Throughput of a stage: bytes produced, time spent in its tasks, and wall time
+ * during which at least one of its tasks was running, the stages interleave */
+struct Stage
+{
+    const char* name;
+    int tasks;
+    double bytes;
+    double busy;
+    int active;
+    double since, wall;
+};
+
+struct Asset
+{
+    int kind;
+    std::string source, variant, output, key;
+    unsigned char* image;
+    int width, height;
+    unsigned char* data;
+    int size, rows, channels, faces;
+    int chunks;
+    bool skipped, failed;
+};
+
+struct Chunk
+{
+    Asset* asset;
+    int begin, end;
+};
+
+typedef void (*TaskRun) (void* arg);
+
+struct Task
+{
+    TaskRun run;
+    void* arg;
+};
+
+/*
+ * Work-stealing pool: every worker pushes the tasks it spawns on its own deque
+ * and takes them back from the same end, idle workers steal from the other end
+ * of the others' deques. The main thread is worker 0.
+ */
+struct Worker
+{
+    std::deque<Task> tasks;
+    pthread_mutex_t mutex;
+    pthread_t tid;
+    int index;
+};
+
+static Worker* workers;
+static int nworkers;
+static int pending;
+static int generation;
+static pthread_mutex_t idlemutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idlecond = PTHREAD_COND_INITIALIZER;
+static __thread int current;
+
+static Stage stages[STAGES] = {
+    { "decode", 0, 0, 0, 0, 0, 0 },
+    { "reproject", 0, 0, 0, 0, 0, 0 },
+    { "atmosphere", 0, 0, 0, 0, 0, 0 },
+    { "write", 0, 0, 0, 0, 0, 0 }
+};
+static pthread_mutex_t stagesmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cloudmaps kept in the history, and width they are decoded to at least */
+static int history = 4;
+static int resolution = 2048;
+static std::string ringbase;
+static std::string imagesdir;
+
+static double now ()
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* A task of the stage starts, returns its start time for account */
+static double enter (int stage)
+{
+    double start = now ();
+
+    pthread_mutex_lock (&stagesmutex);
+    if (stages[stage].active++ == 0)
+	stages[stage].since = start;
+    pthread_mutex_unlock (&stagesmutex);
+    return start;
+}
+
+static void account (int stage, double start, size_t bytes)
+{
+    double end = now ();
+
+    pthread_mutex_lock (&stagesmutex);
+    if (--stages[stage].active == 0)
+	stages[stage].wall += end - stages[stage].since;
+    stages[stage].tasks++;
+    stages[stage].bytes += bytes;
+    stages[stage].busy += end - start;
+    pthread_mutex_unlock (&stagesmutex);
+}
+
+static void submit (TaskRun run, void* arg)
+{
+    Worker* w = &workers[current];
+    Task task = { run, arg };
+
+    __sync_fetch_and_add (&pending, 1);
+
+    pthread_mutex_lock (&w->mutex);
+    w->tasks.push_back (task);
+    pthread_mutex_unlock (&w->mutex);
+
+    pthread_mutex_lock (&idlemutex);
+    generation++;
+    pthread_cond_broadcast (&idlecond);
+    pthread_mutex_unlock (&idlemutex);
+}
+
+static bool takeTask (int index, Task* task)
+{
+    /* Own tasks first, newest first so their data is still in the cache */
+    for (int i = 0; i < nworkers; i++)
+    {
+	Worker* w = &workers[(index + i) % nworkers];
+	bool found = false;
+
+	pthread_mutex_lock (&w->mutex);
+	if (!w->tasks.empty ())
+	{
+	    if (i == 0)
+	    {
+		*task = w->tasks.back ();
+		w->tasks.pop_back ();
+	    }
+	    else
+	    {
+		*task = w->tasks.front ();
+		w->tasks.pop_front ();
+	    }
+	    found = true;
+	}
+	pthread_mutex_unlock (&w->mutex);
+
+	if (found)
+	    return true;
+    }
+    return false;
+}
+
+static void* workerLoop (void* p)
+{
+    Worker* self = (Worker*) p;
+    Task task;
+
+    current = self->index;
+
+    for (;;)
+    {
+	pthread_mutex_lock (&idlemutex);
+	int seen = generation;
+	pthread_mutex_unlock (&idlemutex);
+
+	if (takeTask (self->index, &task))
+	{
+	    task.run (task.arg);
+
+	    if (__sync_sub_and_fetch (&pending, 1) == 0)
+	    {
+		pthread_mutex_lock (&idlemutex);
+		pthread_cond_broadcast (&idlecond);
+		pthread_mutex_unlock (&idlemutex);
+	    }
+	    continue;
+	}
+
+	/* Nothing to steal, wait for new tasks unless everything is done */
+	pthread_mutex_lock (&idlemutex);
+	while (generation == seen && pending > 0)
+	    pthread_cond_wait (&idlecond, &idlemutex);
+	bool done = (pending == 0);
+	pthread_mutex_unlock (&idlemutex);
+
+	if (done)
+	    break;
+    }
+    return NULL;
+}
+
+static void writeTask (void* arg)
+{
+    Asset* asset = (Asset*) arg;
+    double start = enter (STAGE_WRITE);
+    size_t bytes = (size_t) asset->size * asset->rows * asset->channels;
+
+    if (asset->kind == ASSET_CLOUDS)
+    {
+	struct stat attrib;
+	time_t time = (stat (asset->source.c_str (), &attrib) == 0) ? attrib.st_mtime : 0;
+	CloudsRing ring;
+
+	ring.map = NULL;
+	ring.header = NULL;
+	if (!cloudsRingPush (&ring, asset->output.c_str (), history, asset->data, asset->size, asset->rows, time))
+	    asset->failed = true;
+	cloudsRingClose (&ring);
+    }
+    else
+    {
+	/* Written aside and renamed, so that the plugin never maps a partial file,
+	 * and writable by the user alone whatever the umask, or the plugin rejects it */
+	std::string temp = asset->output + ".XXXXXX";
+	CacheHeader header;
+	int fd = mkstemp (&temp[0]);
+	FILE* file = (fd >= 0 && fchmod (fd, 0644) == 0) ? fdopen (fd, "wb") : NULL;
+
+	memset (&header, 0, sizeof (header));
+	prepFillHeader (&header, asset->key, asset->size, asset->rows / asset->faces, asset->channels, asset->faces);
+
+	if (!file ||
+	    fwrite (&header, sizeof (header), 1, file) != 1 ||
+	    fwrite (asset->data, 1, bytes, file) != bytes ||
+	    fclose (file) != 0 ||
+	    rename (temp.c_str (), asset->output.c_str ()) != 0)
+	{
+	    fprintf (stderr, "earth-prep: unable to write %s\n", asset->output.c_str ());
+	    if (!file && fd >= 0)
+		close (fd);
+	    unlink (temp.c_str ());
+	    asset->failed = true;
+	}
+    }
+
+    free (asset->data);
+    asset->data = NULL;
+    account (STAGE_WRITE, start, bytes);
+}
+
+/* The last chunk of an asset hands it over to the write stage */
+static void chunkDone (Chunk* chunk)
+{
+    Asset* asset = chunk->asset;
+
+    delete chunk;
+    if (__sync_sub_and_fetch (&asset->chunks, 1) == 0)
+    {
+	free (asset->image);
+	asset->image = NULL;
+	submit (writeTask, asset);
+    }
+}
+
+static void reprojectTask (void* arg)
+{
+    Chunk* chunk = (Chunk*) arg;
+    Asset* asset = chunk->asset;
+    double start = enter (STAGE_REPROJECT);
+
+    reprojectCubeRows (asset->image, asset->width, asset->height, 4,
+		       asset->data, asset->size, chunk->begin, chunk->end);
+
+    account (STAGE_REPROJECT, start, (size_t) (chunk->end - chunk->begin) * asset->size * 4);
+    chunkDone (chunk);
+}
+
+static void atmosphereTask (void* arg)
+{
+    Chunk* chunk = (Chunk*) arg;
+    Asset* asset = chunk->asset;
+    double start = enter (STAGE_ATMOSPHERE);
+
+    if (asset->kind == ASSET_TRANSMITTANCE)
+	transmittanceRows ((unsigned short*) asset->data, chunk->begin, chunk->end);
+    else
+	scatteringRows ((unsigned short*) asset->data, chunk->begin, chunk->end);
+
+    account (STAGE_ATMOSPHERE, start, (size_t) (chunk->end - chunk->begin) * asset->size * 8);
+    chunkDone (chunk);
+}
+
+/* Splits the rows of an asset in chunks of rows, each one a task */
+static void submitChunks (Asset* asset, TaskRun run, int rows)
+{
+    int count = (asset->rows + rows - 1) / rows;
+
+    asset->chunks = count;
+    for (int i = 0; i < count; i++)
+    {
+	Chunk* chunk = new Chunk;
+
+	chunk->asset = asset;
+	chunk->begin = i * rows;
+	chunk->end = (i + 1) * rows < asset->rows ? (i + 1) * rows : asset->rows;
+	submit (run, chunk);
+    }
+}
+
+static void decodeTask (void* arg)
+{
+    Asset* asset = (Asset*) arg;
+    double start = enter (STAGE_DECODE);
+    const char* filename = asset->source.c_str ();
+
+    if (asset->kind == ASSET_CLOUDS)
+    {
+	/* Same single channel layout as the plugin uploads */
+	char message[CLOUDS_ERROR_LENGTH];
+
+	asset->data = decodeClouds (filename, resolution, &asset->width, &asset->height, message);
+	if (!asset->data)
+	    fprintf (stderr, "earth-prep: %s: %s\n", filename, message);
+
+	asset->size = asset->width;
+	asset->rows = asset->height;
+	asset->channels = 1;
+    }
+    else
+    {
+	char message[PNG_ERROR_LENGTH];
+
+	asset->image = decodePng (filename, &asset->width, &asset->height, true, message);
+	if (!asset->image)
+	    fprintf (stderr, "earth-prep: %s: %s\n", filename, message);
+	asset->channels = 4;
+    }
+
+    if (!asset->data && !asset->image)
+    {
+	asset->failed = true;
+	account (STAGE_DECODE, start, 0);
+	return;
+    }
+
+    if (asset->kind == ASSET_CLOUDS)
+    {
+	account (STAGE_DECODE, start, (size_t) asset->width * asset->height);
+	submit (writeTask, asset);
+    }
+    else if (asset->kind == ASSET_IMAGE)
+    {
+	account (STAGE_DECODE, start, (size_t) asset->width * asset->height * 4);
+	asset->data = asset->image;
+	asset->image = NULL;
+	asset->size = asset->width;
+	asset->rows = asset->height;
+	submit (writeTask, asset);
+    }
+    else
+    {
+	account (STAGE_DECODE, start, (size_t) asset->width * asset->height * 4);
+	asset->size = cubeFaceSize (asset->width);
+	asset->rows = 6 * asset->size;
+	asset->faces = 6;
+	asset->data = (unsigned char*) malloc ((size_t) asset->rows * asset->size * 4);
+	submitChunks (asset, reprojectTask, CHUNK_ROWS);
+    }
+}
+
+static void startTask (void* arg)
+{
+    Asset* asset = (Asset*) arg;
+
+    if (asset->kind == ASSET_TRANSMITTANCE || asset->kind == ASSET_SCATTERING)
+    {
+	bool transmittance = (asset->kind == ASSET_TRANSMITTANCE);
+
+	asset->size = transmittance ? ATMOSPHERE_TRANSMITTANCE_WIDTH : ATMOSPHERE_SCATTERING_WIDTH;
+	asset->rows = transmittance ? ATMOSPHERE_TRANSMITTANCE_HEIGHT : ATMOSPHERE_SCATTERING_HEIGHT;
+	asset->channels = 8;
+	asset->data = (unsigned char*) malloc ((size_t) asset->size * asset->rows * 8);
+	submitChunks (asset, atmosphereTask, ATMOSPHERE_CHUNK_ROWS);
+    }
+    else
+	decodeTask (asset);
+}
+
+static bool upToDate (Asset* asset)
+{
+    if (asset->kind == ASSET_CLOUDS)
+    {
+	CloudsRing ring;
+	struct stat attrib;
+	time_t newest;
+	bool found = false;
+
+	ring.map = NULL;
+	ring.header = NULL;
+	if (stat (asset->source.c_str (), &attrib) == 0 &&
+	    cloudsRingOpen (&ring, asset->output.c_str (), history) &&
+	    cloudsRingEntry (&ring, 0, &newest))
+	    found = (newest >= attrib.st_mtime);
+	cloudsRingClose (&ring);
+	return found;
+    }
+
+    size_t length;
+    int fd = open (asset->output.c_str (), O_RDONLY);
+    void* map = prepMap (fd, asset->key, &length);
+
+    if (fd >= 0)
+	close (fd);
+    if (!map)
+	return false;
+    munmap (map, length);
+    return true;
+}
+
+static void addAsset (std::vector<Asset*>& assets, int kind, const std::string& source, const std::string& variant)
+{
+    struct stat attrib;
+
+    if (!source.empty () && stat (source.c_str (), &attrib) != 0)
+	return;
+
+    Asset* asset = new Asset;
+    asset->kind = kind;
+    asset->source = source;
+    asset->variant = variant;
+    asset->output = prepFile (source, variant, imagesdir);
+    if (kind == ASSET_CLOUDS)
+    {
+	/* The history of the size it decodes to, as the plugin picks it */
+	int width = 0, height = 0;
+
+	cloudsSize (source.c_str (), resolution, &width, &height);
+	asset->output = cloudsRingFile (ringbase, history, width, height);
+    }
+    asset->key = prepKey (source, variant);
+    asset->image = NULL;
+    asset->data = NULL;
+    asset->width = asset->height = 0;
+    asset->size = asset->rows = asset->channels = 0;
+    asset->faces = 1;
+    asset->chunks = 0;
+    asset->skipped = asset->failed = false;
+    assets.push_back (asset);
+}
+
+/* mkdir -p of the directory holding path */
+static void makeDirectories (const std::string& path)
+{
+    for (size_t slash = path.find ('/', 1); slash != std::string::npos; slash = path.find ('/', slash + 1))
+	mkdir (path.substr (0, slash).c_str (), 0755);
+}
+
+static void usage ()
+{
+    fprintf (stderr, "usage: earth-prep [-f] [-j threads] [-r resolution] [-n history] [images directory]\n"
+		     "  -f  process the sources even when the outputs are up to date\n"
+		     "  -j  number of threads, one per core by default\n"
+		     "  -r  width the downloaded cloudmap is decoded to at least (2048)\n"
+		     "  -n  cloudmaps kept in the history, as the cloud_history option (4)\n"
+		     "All the outputs go under the images directory, ~/.compiz-1/earth/images by default,\n"
+		     "which is the only one the plugin reads.\n");
+}
+
+int main (int argc, char** argv)
+{
+    bool force = false;
+    int threads = sysconf (_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt (argc, argv, "fj:r:n:h")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'f':	force = true;			break;
+	    case 'j':	threads = atoi (optarg);	break;
+	    case 'r':	resolution = atoi (optarg);	break;
+	    case 'n':	history = atoi (optarg);	break;
+	    default:	usage ();			return 1;
+	}
+    }
+    if (optind < argc - 1 || threads < 1 || resolution < 1 || history < 2 || history > CLOUDS_RING_MAX)
+    {
+	usage ();
+	return 1;
+    }
+
+    const char* home = getenv ("HOME");
+    std::string dir = (optind < argc) ? argv[optind] : std::string (home ? home : "") + "/.compiz-1/earth/images";
+    if (dir.empty () || dir[dir.size () - 1] != '/')
+	dir += "/";
+
+    /* The tables have no source, they go in prep/ under the directory as well */
+    imagesdir = dir;
+    ringbase = dir + "clouds";
+    makeDirectories (prepFile (dir + "day.png", "cube"));
+
+    /* The same sources and variants the plugin asks the cache for: the maps both as
+     * cubemaps and as they are, which the automatic projection picks on software renderers */
+    std::vector<Asset*> assets;
+    std::vector<std::string> maps;
+
+    maps.push_back ("day.png");
+    for (int m = 1; m <= 12; m++)
+    {
+	char name[16];
+
+	snprintf (name, sizeof (name), "day%02d.png", m);
+	maps.push_back (name);
+    }
+    maps.push_back ("night.png");
+    for (unsigned int i = 0; i < maps.size (); i++)
+    {
+	addAsset (assets, ASSET_CUBE, dir + maps[i], "cube");
+	addAsset (assets, ASSET_IMAGE, dir + maps[i], "");
+    }
+    addAsset (assets, ASSET_IMAGE, dir + "skydome.png", "");
+
+    /* Only the downloaded cloudmap has a history, the plugin reads its clouds.png fallback itself */
+    addAsset (assets, ASSET_CLOUDS, dir + "clouds.jpg", "");
+    addAsset (assets, ASSET_TRANSMITTANCE, "", ATMOSPHERE_TRANSMITTANCE_VARIANT);
+    addAsset (assets, ASSET_SCATTERING, "", ATMOSPHERE_SCATTERING_VARIANT);
+
+    nworkers = threads;
+    workers = new Worker[nworkers];
+    for (int i = 0; i < nworkers; i++)
+    {
+	pthread_mutex_init (&workers[i].mutex, NULL);
+	workers[i].index = i;
+    }
+
+    /* Incremental: sources whose output still holds their key are skipped */
+    int scheduled = 0;
+    for (unsigned int i = 0; i < assets.size (); i++)
+    {
+	if (!force && upToDate (assets[i]))
+	{
+	    printf ("%s: up to date\n", assets[i]->output.c_str ());
+	    assets[i]->skipped = true;
+	    continue;
+	}
+	submit (startTask, assets[i]);
+	scheduled++;
+    }
+
+    double start = now ();
+
+    if (scheduled)
+    {
+	for (int i = 1; i < nworkers; i++)
+	    if (pthread_create (&workers[i].tid, NULL, workerLoop, &workers[i]) != 0)
+		workers[i].tid = 0;
+
+	workerLoop (&workers[0]);
+
+	for (int i = 1; i < nworkers; i++)
+	    if (workers[i].tid)
+		pthread_join (workers[i].tid, NULL);
+    }
+
+    double total = now () - start;
+    int failed = 0;
+
+    for (unsigned int i = 0; i < assets.size (); i++)
+    {
+	if (!assets[i]->skipped)
+	{
+	    printf ("%s: %s\n", assets[i]->output.c_str (), assets[i]->failed ? "failed" : "written");
+	    failed += assets[i]->failed;
+	}
+	free (assets[i]->image);
+	free (assets[i]->data);
+	delete assets[i];
+    }
+
+    /* Throughput per stage over the time it was running, cores is the average number of workers busy in it */
+    if (scheduled)
+    {
+	printf ("\n%-12s %6s %10s %9s %10s %7s\n", "stage", "tasks", "MB", "seconds", "MB/s", "cores");
+	for (int s = 0; s < STAGES; s++)
+	{
+	    if (!stages[s].tasks)
+		continue;
+
+	    double wall = stages[s].wall;
+	    double mb = stages[s].bytes / (1024 * 1024);
+
+	    printf ("%-12s %6d %10.1f %9.3f %10.1f %7.2f\n", stages[s].name, stages[s].tasks, mb, wall,
+		    wall > 0 ? mb / wall : 0, wall > 0 ? stages[s].busy / wall : 0);
+	}
+	printf ("%d threads, %.3f seconds\n", nworkers, total);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+	pthread_mutex_destroy (&workers[i].mutex);
+    delete[] workers;
+
+    return failed ? 1 : 0;
+}